@@ -1,229 +1,833 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <ctime>
 #include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <new>
+#include <cstddef>
+#include <sstream>
+#include <fstream>
+#include <condition_variable>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
-template <typename T>
-class CustomStack {
+// Fixed-size block pool shared by every container node of the same size and
+// alignment. Each thread allocates from and frees to its own free list, so
+// the hot path touches no lock and no global heap. Blocks move between
+// threads in batches through a shared depot: a thread that frees more than
+// LOCAL_LIMIT blocks (the consumer of a producer/consumer pair) hands a
+// batch back, and a thread's remaining blocks go there when it exits. Slabs
+// are never released, which keeps nodes valid after the thread that
+// allocated them is gone.
+template <size_t BlockSize, size_t Alignment>
+class NodePool {
 private:
-    struct Node {
-        T data;
-        Node* next;
-        Node(T value) : data(value), next(nullptr) {}
+    union Block {
+        Block* next;
+        alignas(Alignment) unsigned char storage[BlockSize];
     };
 
-    Node* topNode;
-    int currentSize;
+    static constexpr size_t BATCH_SIZE = 256; // Blocks per slab and per depot transfer
+    static constexpr size_t LOCAL_LIMIT = 2 * BATCH_SIZE;
 
-public:
-    CustomStack() : topNode(nullptr), currentSize(0) {}
+    struct Batch {
+        Block* head; // Null-terminated list
+        size_t count;
+    };
+
+    struct Depot {
+        mutex lock;
+        vector<Batch> batches;
+    };
 
-    void push(const T& value) {
-        Node* newNode = new Node(value);
-        newNode->next = topNode;
-        topNode = newNode;
-        ++currentSize;
+    // Set once this thread's cache is destroyed. Trivially destructible, so
+    // it can still be read by containers freed later in thread or static
+    // teardown, which then go to the depot directly.
+    static bool& retired() {
+        thread_local bool flag = false;
+        return flag;
     }
 
-    T pop() {
-        if (isEmpty()) {
-            throw runtime_error("Stack underflow: Attempted to pop from an empty stack.");
+    struct LocalCache {
+        Block* freeList = nullptr;
+        size_t count = 0;
+
+        ~LocalCache() {
+            retired() = true;
+            if (freeList) {
+                giveBack(Batch{ freeList, count });
+            }
         }
-        Node* temp = topNode;
-        T value = temp->data;
-        topNode = topNode->next;
-        delete temp;
-        --currentSize;
-        return value;
+    };
+
+    // Intentionally never destroyed, so containers torn down during static
+    // destruction can still return their nodes
+    static Depot& depot() {
+        static Depot* shared = new Depot();
+        return *shared;
     }
 
-    T peek() const {
-        if (isEmpty()) {
-            throw runtime_error("Stack is empty: Cannot peek.");
+    // Null once the calling thread's cache has been destroyed
+    static LocalCache* local() {
+        if (retired()) {
+            return nullptr;
         }
-        return topNode->data;
+        thread_local LocalCache cache;
+        return &cache;
     }
 
-    bool isEmpty() const {
-        return topNode == nullptr;
+    static void giveBack(Batch batch) {
+        Depot& shared = depot();
+        lock_guard<mutex> guard(shared.lock);
+        shared.batches.push_back(batch);
     }
 
-    int size() const {
-        return currentSize;
+    // A batch from the depot, or a freshly carved slab
+    static Batch takeBatch() {
+        Depot& shared = depot();
+        {
+            lock_guard<mutex> guard(shared.lock);
+            if (!shared.batches.empty()) {
+                Batch batch = shared.batches.back();
+                shared.batches.pop_back();
+                return batch;
+            }
+        }
+        Block* slab = static_cast<Block*>(::operator new(sizeof(Block) * BATCH_SIZE));
+        for (size_t i = 0; i + 1 < BATCH_SIZE; ++i) {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[BATCH_SIZE - 1].next = nullptr;
+        return Batch{ slab, BATCH_SIZE };
     }
 
-    void clear() {
-        while (!isEmpty()) {
-            pop();
+public:
+    static void* allocate() {
+        LocalCache* cache = local();
+        if (!cache) {
+            Batch batch = takeBatch();
+            if (batch.count > 1) {
+                giveBack(Batch{ batch.head->next, batch.count - 1 });
+            }
+            return batch.head;
         }
+        if (!cache->freeList) {
+            Batch batch = takeBatch();
+            cache->freeList = batch.head;
+            cache->count = batch.count;
+        }
+        Block* block = cache->freeList;
+        cache->freeList = block->next;
+        --cache->count;
+        return block;
     }
 
-    ~CustomStack() {
-        clear();
+    static void deallocate(void* pointer) {
+        Block* block = static_cast<Block*>(pointer);
+        LocalCache* cache = local();
+        if (!cache) {
+            block->next = nullptr;
+            giveBack(Batch{ block, 1 });
+            return;
+        }
+        block->next = cache->freeList;
+        cache->freeList = block;
+        if (++cache->count > LOCAL_LIMIT) {
+            Block* tail = block;
+            for (size_t i = 1; i < BATCH_SIZE; ++i) {
+                tail = tail->next;
+            }
+            cache->freeList = tail->next;
+            tail->next = nullptr;
+            cache->count -= BATCH_SIZE;
+            giveBack(Batch{ block, BATCH_SIZE });
+        }
     }
 };
 
-// Custom Queue Template 
+// Default allocator for container nodes: single objects come from the
+// NodePool for their size, arrays fall back to the global heap
 template <typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count) {
+        if (count == 1) {
+            return static_cast<T*>(NodePool<sizeof(T), alignof(T)>::allocate());
+        }
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t count) noexcept {
+        if (count == 1) {
+            NodePool<sizeof(T), alignof(T)>::deallocate(pointer);
+        }
+        else {
+            ::operator delete(pointer);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+// Custom Queue Template 
+// Growable ring buffer with a power-of-two capacity. Elements can be read
+// in place through const iterators instead of copying the queue.
+template <typename T, typename Alloc = PoolAllocator<T>>
 class CustomQueue {
 private:
-    struct QueueNode {
-        T data;
-        QueueNode* next;
-        QueueNode(T value) : data(value), next(nullptr) {}
-    };
+    typedef allocator_traits<Alloc> Traits;
+
+    Alloc allocator;
+    T* buffer;
+    size_t capacity;
+    size_t head;
+    size_t count;
+
+    T* slot(size_t index) const {
+        return buffer + ((head + index) & (capacity - 1));
+    }
+
+    void reallocate(size_t newCapacity) {
+        T* grown = Traits::allocate(allocator, newCapacity);
+        for (size_t i = 0; i < count; ++i) {
+            T* source = slot(i);
+            Traits::construct(allocator, grown + i, std::move(*source));
+            Traits::destroy(allocator, source);
+        }
+        if (buffer) {
+            Traits::deallocate(allocator, buffer, capacity);
+        }
+        buffer = grown;
+        capacity = newCapacity;
+        head = 0;
+    }
+
+    void release() {
+        clear();
+        if (buffer) {
+            Traits::deallocate(allocator, buffer, capacity);
+        }
+        buffer = nullptr;
+        capacity = 0;
+    }
+
 public:
-    QueueNode* frontNode;
-    QueueNode* rearNode;
+    class const_iterator {
+    private:
+        const CustomQueue* queue;
+        size_t index;
 
-    CustomQueue() : frontNode(nullptr), rearNode(nullptr) {}
+    public:
+        const_iterator(const CustomQueue* owner, size_t position) : queue(owner), index(position) {}
 
-    void enqueue(T value) {
-        QueueNode* newNode = new QueueNode(value);
-        if (isEmpty()) {
-            frontNode = rearNode = newNode;
+        const T& operator*() const {
+            return *queue->slot(index);
         }
-        else {
-            rearNode->next = newNode;
-            rearNode = newNode;
+
+        const T* operator->() const {
+            return queue->slot(index);
+        }
+
+        const_iterator& operator++() {
+            ++index;
+            return *this;
         }
+
+        bool operator==(const const_iterator& other) const {
+            return index == other.index;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return index != other.index;
+        }
+    };
+
+    CustomQueue(const Alloc& alloc = Alloc()) :
+        allocator(alloc), buffer(nullptr), capacity(0), head(0), count(0) {}
+
+    void reserve(size_t minimumCapacity) {
+        if (minimumCapacity <= capacity) {
+            return;
+        }
+        size_t newCapacity = max<size_t>(capacity, 4);
+        while (newCapacity < minimumCapacity) {
+            newCapacity *= 2;
+        }
+        reallocate(newCapacity);
+    }
+
+    void enqueue(const T& value) {
+        if (count == capacity) {
+            reserve(count + 1);
+        }
+        Traits::construct(allocator, slot(count), value);
+        ++count;
+    }
+
+    void enqueue(T&& value) {
+        if (count == capacity) {
+            reserve(count + 1);
+        }
+        Traits::construct(allocator, slot(count), std::move(value));
+        ++count;
     }
 
     T dequeue() {
         if (isEmpty()) throw runtime_error("Queue is empty");
-        QueueNode* temp = frontNode;
-        T value = temp->data;
-        frontNode = frontNode->next;
-        if (frontNode == nullptr) rearNode = nullptr;
-        delete temp;
+        T* front = slot(0);
+        T value = std::move(*front);
+        Traits::destroy(allocator, front);
+        head = (head + 1) & (capacity - 1);
+        --count;
         return value;
     }
 
+    const T& front() const {
+        if (isEmpty()) throw runtime_error("Queue is empty");
+        return *slot(0);
+    }
+
     bool isEmpty() const {
-        return frontNode == nullptr;
+        return count == 0;
     }
 
     int size() const {
-        int count = 0;
-        QueueNode* current = frontNode;
-        while (current) {
-            count++;
-            current = current->next;
-        }
-        return count;
+        return static_cast<int>(count);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, count);
     }
 
-    void display() {
-        QueueNode* current = frontNode;
+    void display() const {
         int index = 1;
-        while (current) {
-            cout << index++ << ". " << current->data << endl;
-            current = current->next;
+        for (const T& item : *this) {
+            cout << index++ << ". " << item << endl;
         }
     }
 
     void clear() {
-        while (!isEmpty()) {
-            dequeue();
+        for (size_t i = 0; i < count; ++i) {
+            Traits::destroy(allocator, slot(i));
         }
+        head = 0;
+        count = 0;
     }
 
     // Copy constructor and assignment operator
-    CustomQueue(const CustomQueue& other) : frontNode(nullptr), rearNode(nullptr) {
-        QueueNode* current = other.frontNode;
-        while (current) {
-            enqueue(current->data);
-            current = current->next;
+    CustomQueue(const CustomQueue& other) :
+        allocator(Traits::select_on_container_copy_construction(other.allocator)),
+        buffer(nullptr), capacity(0), head(0), count(0) {
+        reserve(other.count);
+        for (const T& item : other) {
+            enqueue(item);
         }
     }
 
     CustomQueue& operator=(const CustomQueue& other) {
         if (this != &other) {
             clear();
-            QueueNode* current = other.frontNode;
-            while (current) {
-                enqueue(current->data);
-                current = current->next;
+            reserve(other.count);
+            for (const T& item : other) {
+                enqueue(item);
             }
         }
         return *this;
     }
+
+    // Move constructor and assignment operator
+    CustomQueue(CustomQueue&& other) noexcept :
+        allocator(std::move(other.allocator)), buffer(other.buffer),
+        capacity(other.capacity), head(other.head), count(other.count) {
+        other.buffer = nullptr;
+        other.capacity = other.head = other.count = 0;
+    }
+
+    CustomQueue& operator=(CustomQueue&& other) noexcept {
+        if (this != &other) {
+            release();
+            buffer = other.buffer;
+            capacity = other.capacity;
+            head = other.head;
+            count = other.count;
+            other.buffer = nullptr;
+            other.capacity = other.head = other.count = 0;
+        }
+        return *this;
+    }
+
     ~CustomQueue() {
-        clear();
+        release();
+    }
+};
+
+// Lock-free multi-producer/single-consumer inbox. Producers push with one
+// CAS on the head of an intrusive list, so concurrent senders never wait on
+// a lock. The single consumer detaches everything pushed so far with one
+// exchange and receives the batch oldest first. A count of waiting items
+// lets producers notice a consumer falling behind.
+template <typename T, typename Alloc = PoolAllocator<T>>
+class MpscInbox {
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    typedef typename allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+    typedef allocator_traits<NodeAlloc> Traits;
+
+    NodeAlloc allocator;
+    atomic<Node*> head;     // Newest first
+    atomic<size_t> waiting; // Counted before the push, so never below the real count
+
+public:
+    MpscInbox(const Alloc& alloc = Alloc()) : allocator(alloc), head(nullptr), waiting(0) {}
+
+    MpscInbox(const MpscInbox&) = delete;
+    MpscInbox& operator=(const MpscInbox&) = delete;
+
+    // Safe to call from any number of threads. Returns how many items are
+    // waiting, this one included; concurrent pushes may be counted early.
+    size_t push(T value) {
+        size_t count = waiting.fetch_add(1, memory_order_relaxed) + 1;
+        Node* node = Traits::allocate(allocator, 1);
+        Traits::construct(allocator, node, Node{ std::move(value), head.load(memory_order_relaxed) });
+        while (!head.compare_exchange_weak(node->next, node, memory_order_release, memory_order_relaxed)) {
+        }
+        return count;
+    }
+
+    // Hands every pending item to fn in push order and returns how many there
+    // were. Only one thread may drain at a time.
+    template <typename Fn>
+    size_t drain(Fn&& fn) {
+        Node* batch = head.exchange(nullptr, memory_order_acquire);
+        Node* oldest = nullptr;
+        while (batch) {
+            Node* next = batch->next;
+            batch->next = oldest;
+            oldest = batch;
+            batch = next;
+        }
+
+        size_t drained = 0;
+        while (oldest) {
+            Node* next = oldest->next;
+            fn(std::move(oldest->value));
+            Traits::destroy(allocator, oldest);
+            Traits::deallocate(allocator, oldest, 1);
+            oldest = next;
+            ++drained;
+        }
+        waiting.fetch_sub(drained, memory_order_relaxed);
+        return drained;
+    }
+
+    bool isEmpty() const {
+        return head.load(memory_order_acquire) == nullptr;
+    }
+
+    ~MpscInbox() {
+        drain([](T&&) {});
+    }
+};
+
+// Vector whose elements never move. Storage is a directory of fixed-size
+// segments allocated on demand, so growing it never invalidates references
+// held by other threads. ensure() may race with other ensure() calls; the
+// caller is responsible for publishing which indices are in use.
+template <typename T, size_t SegmentBits = 12, size_t MaxSegments = (1 << 16)>
+class SegmentedVector {
+private:
+    static constexpr size_t SEGMENT_SIZE = size_t(1) << SegmentBits;
+
+    unique_ptr<atomic<T*>[]> segments;
+
+public:
+    SegmentedVector() : segments(new atomic<T*>[MaxSegments]) {
+        for (size_t i = 0; i < MaxSegments; ++i) {
+            segments[i].store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    SegmentedVector(const SegmentedVector&) = delete;
+    SegmentedVector& operator=(const SegmentedVector&) = delete;
+
+    ~SegmentedVector() {
+        for (size_t i = 0; i < MaxSegments; ++i) {
+            delete[] segments[i].load(memory_order_relaxed);
+        }
+    }
+
+    // Makes index addressable, allocating its segment if needed
+    T& ensure(size_t index) {
+        if (index >= SEGMENT_SIZE * MaxSegments) {
+            throw length_error("SegmentedVector capacity exceeded");
+        }
+        atomic<T*>& segment = segments[index >> SegmentBits];
+        T* current = segment.load(memory_order_acquire);
+        if (!current) {
+            T* fresh = new T[SEGMENT_SIZE];
+            if (segment.compare_exchange_strong(current, fresh, memory_order_acq_rel)) {
+                current = fresh;
+            }
+            else {
+                delete[] fresh;
+            }
+        }
+        return current[index & (SEGMENT_SIZE - 1)];
+    }
+
+    // index must already have been passed to ensure()
+    T& operator[](size_t index) const {
+        return segments[index >> SegmentBits].load(memory_order_acquire)[index & (SEGMENT_SIZE - 1)];
     }
 };
 
 // Custom Time Utility
+// Wall-clock time in microseconds since the Unix epoch (UTC): 8 bytes per
+// record and directly comparable. Calendar fields are only worked out, in
+// local time, when the time is printed.
 struct CustomTime {
-    int year, month, day, hour, minute;
+    int64_t microseconds = 0;
 
-    static CustomTime getCurrentTime() {
-        time_t now = time(0);
-        tm ltm;
+    // While set, the clock reports this time instead. Log replay pins it to
+    // each record's original time so replayed mutations keep their timestamps.
+    static const CustomTime*& pinned() {
+        thread_local const CustomTime* pinnedTime = nullptr;
+        return pinnedTime;
+    }
 
-        if (localtime_s(&ltm, &now) != 0) {
-            throw runtime_error("Failed to retrieve local time");
+    // Coarse monotonic clock shifted onto the wall clock by an offset read
+    // once at startup: millisecond-level resolution, but read without a
+    // system call, which matters because every post, message and
+    // notification is stamped. Stepping the wall clock later does not move
+    // it. Each thread's timestamps never decrease, so a thread's events sort
+    // in the order it stamped them without any state shared across threads.
+    static CustomTime getCurrentTime() {
+        if (pinned()) {
+            return *pinned();
         }
+        static const int64_t epochOffset = wallClock() - monotonicClock();
+        thread_local int64_t latest = 0;
+        latest = max(latest, epochOffset + monotonicClock());
+        return CustomTime{ latest };
+    }
 
-        return {
-            1900 + ltm.tm_year,
-            1 + ltm.tm_mon,
-            ltm.tm_mday,
-            ltm.tm_hour,
-            ltm.tm_min
-        };
+    // Microseconds since an arbitrary fixed point
+    static int64_t monotonicClock() {
+#ifdef _WIN32
+        // Milliseconds since boot, updated once per scheduler tick
+        return static_cast<int64_t>(GetTickCount64()) * 1000;
+#else
+        timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+        return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+#endif
+    }
+
+    // Microseconds since the Unix epoch
+    static int64_t wallClock() {
+#ifdef _WIN32
+        // 100 ns ticks since 1601
+        FILETIME fileTime;
+        GetSystemTimeAsFileTime(&fileTime);
+        uint64_t ticks = (static_cast<uint64_t>(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime;
+        return static_cast<int64_t>(ticks / 10) - 11644473600000000LL;
+#else
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+#endif
+    }
+
+    bool operator<(const CustomTime& other) const {
+        return microseconds < other.microseconds;
+    }
+
+    bool operator==(const CustomTime& other) const {
+        return microseconds == other.microseconds;
     }
 
     string toString() const {
+        time_t seconds = static_cast<time_t>(microseconds / 1000000);
+        tm local;
+#ifdef _WIN32
+        bool converted = localtime_s(&local, &seconds) == 0;
+#else
+        bool converted = localtime_r(&seconds, &local) != nullptr;
+#endif
+        if (!converted) {
+            throw runtime_error("Failed to convert time to local time");
+        }
         char buffer[50];
         snprintf(buffer, sizeof(buffer), "%02d/%02d/%04d %02d:%02d",
-            day, month, year, hour, minute);
+            local.tm_mday, 1 + local.tm_mon, 1900 + local.tm_year, local.tm_hour, local.tm_min);
         return string(buffer);
     }
 };
 
 // Structures for enhanced social network features
+// Posts live in the central PostStore; the author is kept as a user ID and
+// the content points into the store's arena
 struct Post {
-    string content;
-    string authorName;
+    uint64_t id;
+    int authorId;
+    string_view content;
     CustomTime timestamp;
 
-    string toString() const {
-        return "Post by " + authorName + ": " + content +
+    string toString(const string& authorName) const {
+        return "Post by " + authorName + ": " + string(content) +
             "\nTime: " + timestamp.toString();
     }
 };
 
+// A direct message; the conversation it is stored in names the recipient
 struct Message {
-    string sender;
+    int senderId;
     string content;
-    bool isRead;
     CustomTime timestamp;
 
-    string toString() const {
-        return "[" + sender + "]: " + content +
-            (isRead ? " (Read)" : " (Unread)");
+    string toString(const string& senderName, bool unread) const {
+        return "[" + senderName + "]: " + content + (unread ? " (Unread)" : "") +
+            " - " + timestamp.toString();
     }
 };
 
+// A notification event as delivered: what happened, who did it and when.
+// Text is only produced when the notification is shown.
 struct Notification {
-    string content;
-    bool isRead;
+    enum Type : uint8_t {
+        MESSAGE = 1,
+        FOLLOW_REQUEST,
+        REQUEST_ACCEPTED
+    };
+    static constexpr int TYPE_COUNT = 3;
+
+    Type type;
+    int actorId;       // User whose action caused the event
+    uint64_t objectId; // MESSAGE: the message's number in its conversation; otherwise 0
     CustomTime timestamp;
+};
 
-    string toString() const {
-        return content + (isRead ? " (Read)" : " (Unread)");
+// A user's notifications, newest RETENTION entries kept. An event is merged
+// into the entry for earlier unread events of the same type when there is
+// one, so a flood of messages bumps a counter ("bob and 41 others sent you
+// messages") instead of growing the list. Entries at or after the read
+// cursor are unread; reading everything just moves the cursor.
+class NotificationFeed {
+public:
+    static constexpr size_t RETENTION = 1000;
+
+    struct Entry {
+        Notification::Type type;
+        int actorId;          // Latest actor
+        uint64_t objectId;    // Of the latest event
+        uint32_t eventCount;
+        uint32_t actorCount;  // Distinct actors
+        CustomTime timestamp; // Latest event
+    };
+
+private:
+    static constexpr uint64_t NO_ENTRY = UINT64_MAX;
+
+    // Entries still open for merging, by type, with the actors seen so far;
+    // allocated on the first unread event and dropped once all are read
+    struct OpenEntries {
+        uint64_t position[Notification::TYPE_COUNT + 1];
+        unordered_set<int> actors[Notification::TYPE_COUNT + 1];
+
+        OpenEntries() {
+            fill(begin(position), end(position), NO_ENTRY);
+        }
+    };
+
+    vector<Entry> ring;    // Entry at position p lives in ring[p % RETENTION]
+    uint64_t appended;     // Positions ever used
+    uint64_t readCursor;   // First unread position
+    unique_ptr<OpenEntries> open;
+
+    uint64_t oldest() const {
+        return appended > ring.size() ? appended - ring.size() : 0;
+    }
+
+    Entry& at(uint64_t position) {
+        return ring[position % RETENTION];
+    }
+
+    void append(const Entry& entry) {
+        if (ring.size() < RETENTION) {
+            ring.push_back(entry);
+        }
+        else {
+            at(appended) = entry;
+        }
+        ++appended;
+        readCursor = max(readCursor, oldest());
+    }
+
+public:
+    NotificationFeed() : appended(0), readCursor(0) {}
+
+    size_t size() const {
+        return ring.size();
+    }
+
+    size_t unreadCount() const {
+        return static_cast<size_t>(appended - readCursor);
+    }
+
+    void add(const Notification& event) {
+        if (!open) {
+            open.reset(new OpenEntries());
+        }
+        uint64_t& position = open->position[event.type];
+        unordered_set<int>& actors = open->actors[event.type];
+        if (position != NO_ENTRY && position >= oldest()) {
+            Entry& entry = at(position);
+            entry.actorId = event.actorId;
+            entry.objectId = event.objectId;
+            entry.eventCount++;
+            entry.timestamp = event.timestamp;
+            if (actors.insert(event.actorId).second) {
+                entry.actorCount++;
+            }
+            return;
+        }
+        position = appended;
+        actors.clear();
+        actors.insert(event.actorId);
+        append(Entry{ event.type, event.actorId, event.objectId, 1, 1, event.timestamp });
+    }
+
+    // Oldest first; fn(entry, unread, openActors), where openActors is the
+    // set of distinct actors of an entry still open for merging, else null
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (uint64_t position = oldest(); position < appended; ++position) {
+            const Entry& entry = ring[position % RETENTION];
+            bool isOpen = open && open->position[entry.type] == position;
+            fn(entry, position >= readCursor, isOpen ? &open->actors[entry.type] : nullptr);
+        }
+    }
+
+    void markAllRead() {
+        readCursor = appended;
+        open.reset();
+    }
+
+    // Appends an entry loaded from a snapshot. An unread entry that was
+    // open for merging comes with its entry.actorCount distinct actors.
+    void restore(const Entry& entry, bool unread, const int32_t* openActors) {
+        if (openActors && unread) {
+            if (!open) {
+                open.reset(new OpenEntries());
+            }
+            open->position[entry.type] = appended;
+            open->actors[entry.type] = unordered_set<int>(openActors, openActors + entry.actorCount);
+        }
+        append(entry);
+        if (!unread) {
+            readCursor = appended;
+        }
+    }
+
+    // Text of an entry; nameOf(userId) returns a username
+    template <typename NameOf>
+    static string render(const Entry& entry, NameOf&& nameOf) {
+        string actor = nameOf(entry.actorId);
+        string others = entry.actorCount > 1 ?
+            " and " + to_string(entry.actorCount - 1) + (entry.actorCount == 2 ? " other" : " others") : "";
+        switch (entry.type) {
+        case Notification::MESSAGE:
+            if (entry.eventCount == 1) {
+                return "New message from " + actor;
+            }
+            if (entry.actorCount == 1) {
+                return actor + " sent you " + to_string(entry.eventCount) + " messages";
+            }
+            return actor + others + " sent you " + to_string(entry.eventCount) + " messages";
+        case Notification::FOLLOW_REQUEST:
+            if (entry.actorCount == 1) {
+                return "Follow request from " + actor;
+            }
+            return actor + others + " requested to follow you";
+        case Notification::REQUEST_ACCEPTED:
+            if (entry.actorCount == 1) {
+                return "Follow request accepted by " + actor;
+            }
+            return actor + others + " accepted your follow requests";
+        }
+        return "Unknown notification";
     }
 };
 // Forward declaration 
 class UserProfile;
 class GraphNode;
+class SocialNetworkGraph;
 
 // Authenticator for enhanced security
 class UserAuthenticator {
-private:
+public:
+    // Checks the password rules without printing anything
     bool isValidPassword(const string& password) {
         if (password.length() < 8) {
             return false;
@@ -251,7 +855,7 @@ private:
         }
         return hasLowercase && hasUppercase && hasDigit && hasSpecialChar;
     }
-public:
+
     bool validatePassword(const string& password) {
         if (!isValidPassword(password)) {
             cout << "Password must be at least 8 characters long and contain:" << endl;
@@ -265,200 +869,3767 @@ public:
     }
 };
 
-// GraphNode class declaration
-class GraphNode {
-public:
-    UserProfile* user;
-    GraphNode* next;
-    CustomQueue<GraphNode*> connections;
-    CustomQueue<GraphNode*> pendingRequests;
-
-    GraphNode(UserProfile* userProfile);
-};
+// Compressed adjacency store (CSR) indexed by dense user IDs.
+// Neighbors of vertex v live in neighbors[offsets[v] .. offsets[v + 1]), sorted.
+// New edges go to a per-vertex delta buffer that is merged into the
+// compressed arrays once it grows past a fraction of the edge count.
+// The compressed neighbor array can also be borrowed from a memory-mapped
+// snapshot; the first merge replaces it with an owned copy.
+class CompactAdjacency {
+private:
+    vector<int> offsets;
+    vector<int> neighbors;      // Owned storage, unused while borrowing
+    const int* neighborData;    // Either neighbors.data() or borrowed memory
+    size_t neighborCount;
+    vector<vector<int>> delta;
+    int deltaEdges;
+
+    int mergeThreshold() const {
+        return max(1024, static_cast<int>(neighborCount / 8));
+    }
 
-// UserProfile class declaration
-class UserProfile {
 public:
-    string name;
-    string password;
-    string securityQuestion;
-    string securityAnswer;
-    string city;
-    CustomTime lastLogin;
-
-    CustomStack<Post> posts;
-    CustomStack<Message> messages;
-    CustomQueue<Notification> notifications;
-    CustomQueue<UserProfile*> followers;
-    CustomQueue<UserProfile*> following;
+    CompactAdjacency() : offsets(1, 0), neighborData(nullptr), neighborCount(0), deltaEdges(0) {}
 
-    UserProfile(string n, string p, string sq, string sa, string c);
+    CompactAdjacency(const CompactAdjacency&) = delete;
+    CompactAdjacency& operator=(const CompactAdjacency&) = delete;
 
-    void sendMessage(UserProfile* recipient, const string& content);
-    void createPost(const string& content);
-    void sendFollowRequest(GraphNode* requesterNode, GraphNode* targetNode);
-    void acceptFollowRequest(GraphNode* graphNode, int requestIndex);
-    void displayFollowers();
-    void displayFollowing();
-    void displayTimeline();
-    void displayNewsfeed();
-    void displayNotifications();
-    void displayMessages();
-    void displayConnections(GraphNode* graphNode);
-    void displayPendingRequests(GraphNode* graphNode);
-    string getProfileInfo() const {
-        return "Username: " + name + "\nCity: " + city + "\nLast Login: " + lastLogin.toString();
+    int addVertex() {
+        offsets.push_back(offsets.back());
+        delta.emplace_back();
+        return vertexCount() - 1;
     }
-};
-
-// GraphNode constructor definition
-GraphNode::GraphNode(UserProfile* userProfile) :
-    user(userProfile), next(nullptr) {}
 
-// Social Network Graph Management
-class SocialNetworkGraph {
-private:
-    GraphNode* userGraph;
-    CustomQueue<GraphNode*> users;
-    UserAuthenticator authenticator;
+    int vertexCount() const {
+        return static_cast<int>(delta.size());
+    }
 
-public:
-    SocialNetworkGraph() : userGraph(nullptr) {}
+    int edgeCount() const {
+        return static_cast<int>(neighborCount) + deltaEdges;
+    }
 
-    void addUser(GraphNode* newUserNode) {
-        if (!newUserNode) {
-            cout << "Error: Attempted to add a null user node." << endl;
-            return;
+    // Adds the directed edge u -> v
+    void addEdge(int u, int v) {
+        delta[u].push_back(v);
+        if (++deltaEdges > mergeThreshold()) {
+            compact();
         }
-        users.enqueue(newUserNode);
-        // Insert at the beginning of the graph
-        newUserNode->next = userGraph;
-        userGraph = newUserNode;
     }
 
-    GraphNode* findUser(const string& username) {
-        GraphNode* current = userGraph;
-        while (current) {
-            if (current->user->name == username) {
-                return current;
-            }
-            current = current->next;
+    bool hasEdge(int u, int v) const {
+        if (binary_search(neighborData + offsets[u], neighborData + offsets[u + 1], v)) {
+            return true;
         }
-        return nullptr;
+        return find(delta[u].begin(), delta[u].end(), v) != delta[u].end();
     }
 
-    void suggestMutualFriends(GraphNode* userNode) {
-        cout << "Mutual Friends Suggestions for " << userNode->user->name << ":" << endl;
+    int degree(int u) const {
+        return offsets[u + 1] - offsets[u] + static_cast<int>(delta[u].size());
+    }
 
-        GraphNode* current = userGraph;
-        while (current) {
-            // Skip the current user and existing connections
-            if (current != userNode && !isConnected(userNode, current)) {
-                int mutualCount = countMutualConnections(userNode, current);
-                if (mutualCount > 0) {
-                    cout << current->user->name << " (Mutual Connections: " << mutualCount << ")" << endl;
-                }
-            }
-            current = current->next;
+    // i-th neighbor of u, counting the compressed slice before the delta buffer
+    int neighborAt(int u, int i) const {
+        int compressed = offsets[u + 1] - offsets[u];
+        return i < compressed ? neighborData[offsets[u] + i] : delta[u][i - compressed];
+    }
+
+    template <typename Fn>
+    void forEachNeighbor(int u, Fn&& fn) const {
+        for (int i = offsets[u]; i < offsets[u + 1]; ++i) {
+            fn(neighborData[i]);
+        }
+        for (int v : delta[u]) {
+            fn(v);
         }
     }
 
-    // Breadth-First Search (BFS)
-    void bfsTraversal(GraphNode* startNode) {
-        if (!startNode) {
-            cout << "Error: Start node is null." << endl;
+    // Merges the delta buffer into the compressed arrays
+    void compact() {
+        if (deltaEdges == 0) {
             return;
         }
+        vector<int> mergedOffsets(offsets.size());
+        vector<int> merged;
+        merged.reserve(neighborCount + deltaEdges);
+        for (int u = 0; u < vertexCount(); ++u) {
+            mergedOffsets[u] = static_cast<int>(merged.size());
+            merged.insert(merged.end(), neighborData + offsets[u], neighborData + offsets[u + 1]);
+            if (!delta[u].empty()) {
+                size_t middle = merged.size();
+                merged.insert(merged.end(), delta[u].begin(), delta[u].end());
+                sort(merged.begin() + middle, merged.end());
+                inplace_merge(merged.begin() + mergedOffsets[u], merged.begin() + middle, merged.end());
+                delta[u].clear();
+            }
+        }
+        mergedOffsets[vertexCount()] = static_cast<int>(merged.size());
+        offsets.swap(mergedOffsets);
+        neighbors.swap(merged);
+        neighborData = neighbors.data();
+        neighborCount = neighbors.size();
+        deltaEdges = 0;
+    }
+
+    // Compressed arrays; they hold every edge only right after compact()
+    const vector<int>& compressedOffsets() const {
+        return offsets;
+    }
+
+    const int* compressedNeighbors() const {
+        return neighborData;
+    }
+
+    // Replaces the edges of a store with no edges by a compressed CSR whose
+    // neighbor array is borrowed and must outlive this store's use of it
+    void adopt(vector<int> compressedOffsets, const int* borrowedNeighbors, size_t count) {
+        if (compressedOffsets.size() != offsets.size() || deltaEdges != 0 || neighborCount != 0) {
+            throw runtime_error("Adjacency does not match the adopted CSR arrays");
+        }
+        offsets = std::move(compressedOffsets);
+        neighbors.clear();
+        neighborData = borrowedNeighbors;
+        neighborCount = count;
+    }
+
+    // Copies a borrowed neighbor array into owned storage
+    void ownNeighbors() {
+        if (neighborCount > 0 && neighborData != neighbors.data()) {
+            neighbors.assign(neighborData, neighborData + neighborCount);
+            neighborData = neighbors.data();
+        }
+    }
+
+    // Same, taking ownership of the neighbor array
+    void adopt(vector<int> compressedOffsets, vector<int> ownedNeighbors) {
+        adopt(std::move(compressedOffsets), nullptr, 0);
+        neighbors = std::move(ownedNeighbors);
+        neighborData = neighbors.data();
+        neighborCount = neighbors.size();
+    }
+};
 
-        CustomQueue<GraphNode*> queue;
-        CustomQueue<GraphNode*> visited; // Using a queue for visited nodes
+// Adjacency split into SHARD_COUNT independent CSR stores. User u lives in
+// shard u % SHARD_COUNT at local index u / SHARD_COUNT, and neighbor lists
+// hold global IDs. Each shard grows and compacts on its own, so a writer
+// only needs the locks of the shards whose rows it changes.
+class ShardedAdjacency {
+public:
+    static constexpr int SHARD_COUNT = 16;
 
-        queue.enqueue(startNode);
-        visited.enqueue(startNode);
+    static int shardOf(int u) {
+        return u % SHARD_COUNT;
+    }
 
-        cout << "BFS Traversal: ";
-        while (!queue.isEmpty()) {
-            GraphNode* current = queue.dequeue();
-            cout << current->user->name << " ";
+private:
+    CompactAdjacency shards[SHARD_COUNT];
+    atomic<int> vertices;
+
+    static int localOf(int u) {
+        return u / SHARD_COUNT;
+    }
+
+public:
+    ShardedAdjacency() : vertices(0) {}
+
+    // IDs must be added in increasing order; only u's shard is modified
+    void addVertex(int u) {
+        shards[shardOf(u)].addVertex();
+        vertices.store(u + 1, memory_order_release);
+    }
+
+    int vertexCount() const {
+        return vertices.load(memory_order_acquire);
+    }
+
+    long long edgeCount() const {
+        long long total = 0;
+        for (const CompactAdjacency& shard : shards) {
+            total += shard.edgeCount();
+        }
+        return total;
+    }
+
+    // Adds the directed edge u -> v, modifying only u's shard
+    void addEdge(int u, int v) {
+        shards[shardOf(u)].addEdge(localOf(u), v);
+    }
+
+    bool hasEdge(int u, int v) const {
+        return shards[shardOf(u)].hasEdge(localOf(u), v);
+    }
+
+    int degree(int u) const {
+        return shards[shardOf(u)].degree(localOf(u));
+    }
+
+    int neighborAt(int u, int i) const {
+        return shards[shardOf(u)].neighborAt(localOf(u), i);
+    }
+
+    template <typename Fn>
+    void forEachNeighbor(int u, Fn&& fn) const {
+        shards[shardOf(u)].forEachNeighbor(localOf(u), fn);
+    }
+
+    CompactAdjacency& shard(int index) {
+        return shards[index];
+    }
+
+    const CompactAdjacency& shard(int index) const {
+        return shards[index];
+    }
+};
+
+// Reusable BFS/DFS engine over the friend graph. Visited state is an
+// epoch-stamped array, so starting a traversal is O(1) instead of O(V), and
+// both the BFS frontier and the DFS stack are explicit buffers kept between
+// calls. Visitors receive (userId, depth) and return false to stop early.
+class TraversalEngine {
+private:
+    vector<uint32_t> visitedEpoch;
+    uint32_t epoch;
+    vector<int> frontier;
+    vector<pair<int, int>> stack; // (vertex, next neighbor position)
+    vector<int> depths;
+
+    void beginTraversal(int vertexCount) {
+        if (static_cast<int>(visitedEpoch.size()) < vertexCount) {
+            visitedEpoch.resize(vertexCount, 0);
+        }
+        if (++epoch == 0) {
+            fill(visitedEpoch.begin(), visitedEpoch.end(), 0);
+            epoch = 1;
+        }
+    }
 
-            CustomQueue<GraphNode*> connections = current->connections;
-            while (!connections.isEmpty()) {
-                GraphNode* neighbor = connections.dequeue();
-                if (!isVisited(visited, neighbor)) {
-                    queue.enqueue(neighbor);
-                    visited.enqueue(neighbor);
+    bool markVisited(int vertex) {
+        if (visitedEpoch[vertex] == epoch) {
+            return false;
+        }
+        visitedEpoch[vertex] = epoch;
+        return true;
+    }
+
+public:
+    TraversalEngine() : epoch(0) {}
+
+    template <typename Visitor>
+    void breadthFirst(const ShardedAdjacency& graph, int start, Visitor&& visit) {
+        beginTraversal(graph.vertexCount());
+        frontier.clear();
+        frontier.push_back(start);
+        markVisited(start);
+
+        int depth = 0;
+        size_t head = 0;
+        while (head < frontier.size()) {
+            size_t levelEnd = frontier.size();
+            for (; head < levelEnd; ++head) {
+                int current = frontier[head];
+                if (!visit(current, depth)) {
+                    return;
                 }
+                graph.forEachNeighbor(current, [&](int neighbor) {
+                    if (markVisited(neighbor)) {
+                        frontier.push_back(neighbor);
+                    }
+                });
             }
+            ++depth;
         }
-        cout << endl;
     }
 
-    // Depth-First Search (DFS)
-    void dfsTraversal(GraphNode* startNode) {
-        if (!startNode) {
-            cout << "Error: Start node is null." << endl;
+    template <typename Visitor>
+    void depthFirst(const ShardedAdjacency& graph, int start, Visitor&& visit) {
+        beginTraversal(graph.vertexCount());
+        stack.clear();
+        markVisited(start);
+        if (!visit(start, 0)) {
             return;
         }
-
-        CustomQueue<GraphNode*> visited; // Using a queue for visited nodes
-        cout << "DFS Traversal: ";
-        dfsHelper(startNode, visited);
-        cout << endl;
+        stack.emplace_back(start, 0);
+
+        // Same pre-order as the recursive walk: descend into the first
+        // unvisited neighbor, resume the parent's scan when a vertex is done
+        while (!stack.empty()) {
+            pair<int, int>& frame = stack.back();
+            if (frame.second == graph.degree(frame.first)) {
+                stack.pop_back();
+                continue;
+            }
+            int neighbor = graph.neighborAt(frame.first, frame.second++);
+            if (markVisited(neighbor)) {
+                if (!visit(neighbor, static_cast<int>(stack.size()))) {
+                    return;
+                }
+                stack.emplace_back(neighbor, 0);
+            }
+        }
     }
+};
 
+// Multi-threaded, level-synchronous BFS that switches between top-down and
+// bottom-up steps (Beamer's direction-optimizing heuristic). Returns the hop
+// distance from the nearest source for every vertex, or -1 if unreachable.
+class ParallelBfs {
 private:
-    // Helper function for DFS
-    void dfsHelper(GraphNode* node, CustomQueue<GraphNode*>& visited) {
-        visited.enqueue(node);
-        cout << node->user->name << " ";
+    // Switch to bottom-up once frontier edges exceed unexplored edges / ALPHA,
+    // and back to top-down once the frontier shrinks below vertices / BETA
+    static constexpr long long ALPHA = 14;
+    static constexpr long long BETA = 24;
+    // Levels with less work than this run on the calling thread only
+    static constexpr long long MIN_PARALLEL_WORK = 4096;
+
+    // Threads started once per run and woken for each parallel level, so a
+    // high-diameter graph does not pay a thread start and join per level.
+    // Worker t runs task(t); the calling thread runs task(0).
+    class WorkerPool {
+    private:
+        mutex lock;
+        condition_variable wake;
+        condition_variable finished;
+        const function<void(int)>* task;
+        uint64_t generation; // Bumped for each task
+        int participants;    // Workers below this index run the current task
+        int running;         // Workers still running it
+        bool stopping;
+        vector<thread> threads;
+
+        void work(int index) {
+            uint64_t seen = 0;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                if (index >= participants) {
+                    continue;
+                }
+                const function<void(int)>& current = *task;
+                guard.unlock();
+                current(index);
+                guard.lock();
+                if (--running == 0) {
+                    finished.notify_one();
+                }
+            }
+        }
+
+    public:
+        explicit WorkerPool(int workers) :
+            task(nullptr), generation(0), participants(0), running(0), stopping(false) {
+            threads.reserve(workers - 1);
+            for (int t = 1; t < workers; ++t) {
+                threads.emplace_back([this, t]() { work(t); });
+            }
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        ~WorkerPool() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (thread& worker : threads) {
+                worker.join();
+            }
+        }
 
-        CustomQueue<GraphNode*> connections = node->connections;
-        while (!connections.isEmpty()) {
-            GraphNode* neighbor = connections.dequeue();
-            if (!isVisited(visited, neighbor)) {
-                dfsHelper(neighbor, visited);
+        // Runs job(t) for every t in [0, workers) and waits for all of them
+        void run(int workers, const function<void(int)>& job) {
+            {
+                lock_guard<mutex> guard(lock);
+                task = &job;
+                participants = workers;
+                running = workers - 1;
+                ++generation;
             }
+            wake.notify_all();
+            job(0);
+            unique_lock<mutex> guard(lock);
+            finished.wait(guard, [this] { return running == 0; });
+        }
+    };
+
+    const ShardedAdjacency& graph;
+    int threadCount;
+    int vertexCount;
+    unique_ptr<atomic<int>[]> distance;
+    vector<uint64_t> frontierBits;
+    vector<uint64_t> nextBits;
+    unique_ptr<WorkerPool> pool; // Only during run(), and only with several threads
+
+    // Runs fn(threadIndex, begin, end) over [0, count) split into contiguous,
+    // 64-aligned ranges so bottom-up steps own whole bitmap words
+    template <typename Fn>
+    void parallelFor(int workers, long long count, Fn&& fn) {
+        if (workers <= 1) {
+            fn(0, 0LL, count);
+            return;
         }
+        long long chunk = ((count + workers - 1) / workers + 63) & ~63LL;
+        pool->run(workers, [&](int t) {
+            long long begin = min(count, chunk * t);
+            fn(t, begin, min(count, begin + chunk));
+        });
+    }
+
+    int workersFor(long long work) const {
+        return work < MIN_PARALLEL_WORK ? 1 : threadCount;
     }
 
-    bool isVisited(CustomQueue<GraphNode*>& visited, GraphNode* node) {
-        CustomQueue<GraphNode*> temp = visited; // Make a copy to check without modifying original
-        while (!temp.isEmpty()) {
-            if (temp.dequeue() == node) {
-                return true; // Node is already visited
+    long long topDownStep(const vector<int>& frontier, vector<int>& next, int level) {
+        int workers = workersFor(static_cast<long long>(frontier.size()));
+        vector<vector<int>> localNext(workers);
+        vector<long long> localEdges(workers, 0);
+
+        parallelFor(workers, static_cast<long long>(frontier.size()), [&](int t, long long begin, long long end) {
+            for (long long i = begin; i < end; ++i) {
+                graph.forEachNeighbor(frontier[i], [&](int neighbor) {
+                    int unvisited = -1;
+                    if (distance[neighbor].load(memory_order_relaxed) == -1 &&
+                        distance[neighbor].compare_exchange_strong(unvisited, level + 1, memory_order_relaxed)) {
+                        localNext[t].push_back(neighbor);
+                        localEdges[t] += graph.degree(neighbor);
+                    }
+                });
             }
+        });
+
+        next.clear();
+        long long nextEdges = 0;
+        for (int t = 0; t < workers; ++t) {
+            next.insert(next.end(), localNext[t].begin(), localNext[t].end());
+            nextEdges += localEdges[t];
         }
-        return false;
+        return nextEdges;
     }
 
-    bool isConnected(GraphNode* node1, GraphNode* node2) {
-        CustomQueue<GraphNode*> tempConnections = node1->connections;
-        while (!tempConnections.isEmpty()) {
-            GraphNode* current = tempConnections.dequeue();
-            if (current == node2) {
-                return true;
+    long long bottomUpStep(vector<int>& next, int level) {
+        int workers = threadCount;
+        vector<vector<int>> localNext(workers);
+        vector<long long> localEdges(workers, 0);
+        fill(nextBits.begin(), nextBits.end(), 0);
+
+        parallelFor(workers, vertexCount, [&](int t, long long begin, long long end) {
+            for (long long v = begin; v < end; ++v) {
+                if (distance[v].load(memory_order_relaxed) != -1) {
+                    continue;
+                }
+                // Stop at the first parent found in the current frontier
+                int degree = graph.degree(static_cast<int>(v));
+                for (int i = 0; i < degree; ++i) {
+                    int parent = graph.neighborAt(static_cast<int>(v), i);
+                    if (frontierBits[parent >> 6] & (1ULL << (parent & 63))) {
+                        distance[v].store(level + 1, memory_order_relaxed);
+                        nextBits[v >> 6] |= 1ULL << (v & 63);
+                        localNext[t].push_back(static_cast<int>(v));
+                        localEdges[t] += degree;
+                        break;
+                    }
+                }
             }
+        });
+
+        next.clear();
+        long long nextEdges = 0;
+        for (int t = 0; t < workers; ++t) {
+            next.insert(next.end(), localNext[t].begin(), localNext[t].end());
+            nextEdges += localEdges[t];
         }
-        return false;
+        frontierBits.swap(nextBits);
+        return nextEdges;
     }
 
-    int countMutualConnections(GraphNode* node1, GraphNode* node2) {
+public:
+    ParallelBfs(const ShardedAdjacency& adjacency, int threads) :
+        graph(adjacency),
+        threadCount(threads > 0 ? threads : max(1u, thread::hardware_concurrency())),
+        vertexCount(adjacency.vertexCount()) {}
+
+    vector<int> run(const vector<int>& sources) {
+        distance.reset(new atomic<int>[vertexCount]);
+        for (int v = 0; v < vertexCount; ++v) {
+            distance[v].store(-1, memory_order_relaxed);
+        }
+        frontierBits.assign((vertexCount + 63) / 64, 0);
+        nextBits.assign(frontierBits.size(), 0);
+        if (threadCount > 1) {
+            pool.reset(new WorkerPool(threadCount));
+        }
+
+        vector<int> frontier;
+        long long frontierEdges = 0;
+        long long unexploredEdges = graph.edgeCount();
+        for (int source : sources) {
+            if (distance[source].load(memory_order_relaxed) == -1) {
+                distance[source].store(0, memory_order_relaxed);
+                frontier.push_back(source);
+                frontierEdges += graph.degree(source);
+            }
+        }
+
+        bool bottomUp = false;
+        for (int level = 0; !frontier.empty(); ++level) {
+            unexploredEdges -= frontierEdges;
+            if (!bottomUp && frontierEdges > unexploredEdges / ALPHA) {
+                bottomUp = true;
+                fill(frontierBits.begin(), frontierBits.end(), 0);
+                for (int v : frontier) {
+                    frontierBits[v >> 6] |= 1ULL << (v & 63);
+                }
+            }
+            else if (bottomUp && static_cast<long long>(frontier.size()) < vertexCount / BETA) {
+                bottomUp = false;
+            }
+
+            vector<int> next;
+            frontierEdges = bottomUp ? bottomUpStep(next, level) : topDownStep(frontier, next, level);
+            frontier.swap(next);
+        }
+        pool.reset();
+
+        vector<int> result(vertexCount);
+        for (int v = 0; v < vertexCount; ++v) {
+            result[v] = distance[v].load(memory_order_relaxed);
+        }
+        return result;
+    }
+};
+
+// Friends-of-friends engine. Mutual counts are accumulated in a flat,
+// epoch-stamped counter array indexed by user ID while walking only the
+// 2-hop neighborhood, then the best K candidates are kept in a min-heap.
+class MutualFriendEngine {
+public:
+    struct Candidate {
+        int id;
+        int mutualCount;
+    };
+
+private:
+    vector<uint32_t> friendEpoch;
+    vector<uint32_t> countEpoch;
+    vector<int> counts;
+    vector<int> touched;
+    uint32_t epoch;
+
+    void beginQuery(int vertexCount) {
+        if (static_cast<int>(counts.size()) < vertexCount) {
+            friendEpoch.resize(vertexCount, 0);
+            countEpoch.resize(vertexCount, 0);
+            counts.resize(vertexCount, 0);
+        }
+        if (++epoch == 0) {
+            fill(friendEpoch.begin(), friendEpoch.end(), 0);
+            fill(countEpoch.begin(), countEpoch.end(), 0);
+            epoch = 1;
+        }
+        touched.clear();
+    }
+
+public:
+    MutualFriendEngine() : epoch(0) {}
+
+    // Ranks higher mutual counts first, then lower IDs
+    static bool ranksAbove(const Candidate& a, const Candidate& b) {
+        return a.mutualCount != b.mutualCount ? a.mutualCount > b.mutualCount : a.id < b.id;
+    }
+
+    // Marks the friends of user so that several mutual counts against the
+    // same user cost one neighbor scan each
+    void markFriends(const ShardedAdjacency& graph, int user) {
+        beginQuery(graph.vertexCount());
+        graph.forEachNeighbor(user, [&](int friendId) {
+            friendEpoch[friendId] = epoch;
+        });
+    }
+
+    bool isMarked(int user) const {
+        return friendEpoch[user] == epoch;
+    }
+
+    int countMarkedFriends(const ShardedAdjacency& graph, int user) const {
         int mutualCount = 0;
-        CustomQueue<GraphNode*> tempConn1 = node1->connections;
+        graph.forEachNeighbor(user, [&](int friendId) {
+            if (friendEpoch[friendId] == epoch) {
+                mutualCount++;
+            }
+        });
+        return mutualCount;
+    }
+
+    int countMutual(const ShardedAdjacency& graph, int user1, int user2) {
+        markFriends(graph, user1);
+        return countMarkedFriends(graph, user2);
+    }
+
+    vector<Candidate> topK(const ShardedAdjacency& graph, int user, int k) {
+        return topK(graph, user, k, [](int) { return 0; });
+    }
+
+    // Top k users not yet connected to user, ranked by mutual connections
+    // plus bonus(candidate). Only the 2-hop neighborhood is looked at.
+    template <typename Bonus>
+    vector<Candidate> topK(const ShardedAdjacency& graph, int user, int k, Bonus&& bonus) {
+        beginQuery(graph.vertexCount());
+        friendEpoch[user] = epoch;
+        graph.forEachNeighbor(user, [&](int friendId) {
+            friendEpoch[friendId] = epoch;
+        });
+
+        graph.forEachNeighbor(user, [&](int friendId) {
+            graph.forEachNeighbor(friendId, [&](int candidate) {
+                if (friendEpoch[candidate] == epoch) {
+                    return;
+                }
+                if (countEpoch[candidate] != epoch) {
+                    countEpoch[candidate] = epoch;
+                    counts[candidate] = 0;
+                    touched.push_back(candidate);
+                }
+                counts[candidate]++;
+            });
+        });
+
+        // Min-heap on rank keeps the k best seen so far with the worst on top.
+        // Entries carry the boosted score; the real count is restored below.
+        auto worseFirst = [](const Candidate& a, const Candidate& b) { return ranksAbove(a, b); };
+        priority_queue<Candidate, vector<Candidate>, decltype(worseFirst)> best(worseFirst);
+        for (int candidate : touched) {
+            Candidate entry{ candidate, counts[candidate] + bonus(candidate) };
+            if (static_cast<int>(best.size()) < k) {
+                best.push(entry);
+            }
+            else if (k > 0 && ranksAbove(entry, best.top())) {
+                best.pop();
+                best.push(entry);
+            }
+        }
+
+        vector<Candidate> ranked(best.size());
+        for (size_t i = ranked.size(); i > 0; --i) {
+            ranked[i - 1] = Candidate{ best.top().id, counts[best.top().id] };
+            best.pop();
+        }
+        return ranked;
+    }
+
+    // The members (ascending IDs) within two hops of user, as (ID, hops),
+    // friends first and then by ID. inGroup(id) must test membership in O(1).
+    // Works from whichever side is cheaper: checking each member's neighbors
+    // against user's friends, or walking user's 2-hop frontier and testing
+    // each vertex for membership.
+    template <typename InGroup>
+    vector<pair<int, int>> withinTwoHops(const ShardedAdjacency& graph, int user, const vector<int>& members,
+        InGroup&& inGroup) {
+        beginQuery(graph.vertexCount());
+        long long frontierCost = 0;
+        graph.forEachNeighbor(user, [&](int friendId) {
+            friendEpoch[friendId] = epoch;
+            frontierCost += graph.degree(friendId);
+        });
+        // Member rows are not touched unless members.size() <= frontierCost
+        long long memberCost = static_cast<long long>(members.size());
+        for (size_t i = 0; i < members.size() && memberCost <= frontierCost; ++i) {
+            memberCost += graph.degree(members[i]);
+        }
+
+        vector<pair<int, int>> found;
+        if (memberCost <= frontierCost) {
+            for (int member : members) {
+                if (member == user) {
+                    continue;
+                }
+                if (friendEpoch[member] == epoch) {
+                    found.emplace_back(member, 1);
+                    continue;
+                }
+                bool sharesFriend = false;
+                graph.forEachNeighbor(member, [&](int neighbor) {
+                    sharesFriend = sharesFriend || friendEpoch[neighbor] == epoch;
+                });
+                if (sharesFriend) {
+                    found.emplace_back(member, 2);
+                }
+            }
+        }
+        else {
+            countEpoch[user] = epoch;
+            graph.forEachNeighbor(user, [&](int friendId) {
+                if (inGroup(friendId)) {
+                    found.emplace_back(friendId, 1);
+                }
+            });
+            graph.forEachNeighbor(user, [&](int friendId) {
+                graph.forEachNeighbor(friendId, [&](int candidate) {
+                    if (friendEpoch[candidate] == epoch || countEpoch[candidate] == epoch) {
+                        return;
+                    }
+                    countEpoch[candidate] = epoch;
+                    if (inGroup(candidate)) {
+                        found.emplace_back(candidate, 2);
+                    }
+                });
+            });
+        }
+        sort(found.begin(), found.end(), [](const pair<int, int>& a, const pair<int, int>& b) {
+            return a.second != b.second ? a.second < b.second : a.first < b.first;
+        });
+        return found;
+    }
+};
+
+// Per-user cache of the top mutual-friend candidates. A cache is filled on
+// first read and then maintained incrementally as connections are added:
+// a new edge a-b only changes mutual counts between a and friends of b and
+// between b and friends of a, so only those caches are touched.
+class SuggestionCache {
+public:
+    static constexpr int CACHED_SUGGESTIONS = 10;
+
+private:
+    typedef MutualFriendEngine::Candidate Candidate;
+
+    struct Entry {
+        vector<Candidate> ranked; // Best first, at most CACHED_SUGGESTIONS
+        bool valid;
+
+        Entry() : valid(false) {}
+    };
+
+    SegmentedVector<Entry> entries;
+
+    // Candidate gained one mutual friend with user; exactCount computes the
+    // new count when the cache cannot derive it
+    template <typename ExactCount>
+    void applyIncrement(int user, int candidate, ExactCount&& exactCount) {
+        if (!entries[user].valid) {
+            return;
+        }
+        vector<Candidate>& ranked = entries[user].ranked;
+        size_t pos = 0;
+        while (pos < ranked.size() && ranked[pos].id != candidate) {
+            ++pos;
+        }
+
+        if (pos < ranked.size()) {
+            ranked[pos].mutualCount++;
+        }
+        else if (static_cast<int>(ranked.size()) < CACHED_SUGGESTIONS) {
+            // A short list holds every candidate, so this one had no mutual friends
+            ranked.push_back(Candidate{ candidate, 1 });
+            pos = ranked.size() - 1;
+        }
+        else {
+            Candidate entry{ candidate, exactCount() };
+            if (!MutualFriendEngine::ranksAbove(entry, ranked.back())) {
+                return;
+            }
+            ranked.back() = entry;
+            pos = ranked.size() - 1;
+        }
+
+        while (pos > 0 && MutualFriendEngine::ranksAbove(ranked[pos], ranked[pos - 1])) {
+            swap(ranked[pos], ranked[pos - 1]);
+            --pos;
+        }
+    }
 
-        while (!tempConn1.isEmpty()) {
-            GraphNode* conn1 = tempConn1.dequeue();
-            CustomQueue<GraphNode*> tempConn2 = node2->connections;
+    void removeCandidate(int user, int candidate) {
+        if (!entries[user].valid) {
+            return;
+        }
+        vector<Candidate>& ranked = entries[user].ranked;
+        for (size_t pos = 0; pos < ranked.size(); ++pos) {
+            if (ranked[pos].id == candidate) {
+                // A full list may be hiding the next-best candidate
+                if (static_cast<int>(ranked.size()) == CACHED_SUGGESTIONS) {
+                    entries[user].valid = false;
+                }
+                ranked.erase(ranked.begin() + pos);
+                return;
+            }
+        }
+    }
 
-            while (!tempConn2.isEmpty()) {
-                GraphNode* conn2 = tempConn2.dequeue();
-                if (conn1 == conn2) {
-                    mutualCount++;
+    // The new edge made via a common friend of user and each of via's friends
+    void addCommonFriend(const ShardedAdjacency& graph, MutualFriendEngine& engine, int user, int via) {
+        engine.markFriends(graph, user);
+        graph.forEachNeighbor(via, [&](int candidate) {
+            if (candidate == user || engine.isMarked(candidate)) {
+                return;
+            }
+            int count = -1;
+            auto exactCount = [&]() {
+                if (count < 0) {
+                    count = engine.countMarkedFriends(graph, candidate);
                 }
+                return count;
+            };
+            applyIncrement(user, candidate, exactCount);
+            applyIncrement(candidate, user, exactCount);
+        });
+    }
+
+public:
+    void addUser(int user) {
+        entries.ensure(user);
+    }
+
+    // Forces the next get() to recompute user's suggestions
+    void invalidate(int user) {
+        entries[user].valid = false;
+    }
+
+    // Callers filling the same user's entry concurrently must serialize
+    const vector<Candidate>& get(const ShardedAdjacency& graph, MutualFriendEngine& engine, int user) {
+        Entry& entry = entries[user];
+        if (!entry.valid) {
+            entry.ranked = engine.topK(graph, user, CACHED_SUGGESTIONS);
+            entry.valid = true;
+        }
+        return entry.ranked;
+    }
+
+    // Call after the undirected edge a-b has been added to graph
+    void onConnectionAdded(const ShardedAdjacency& graph, MutualFriendEngine& engine, int a, int b) {
+        removeCandidate(a, b);
+        removeCandidate(b, a);
+        addCommonFriend(graph, engine, a, b);
+        addCommonFriend(graph, engine, b, a);
+    }
+};
+
+// Append-only table of every post. Post IDs are dense and start at 1, post
+// text is copied once into an arena of 1 MB chunks that never move, and each
+// author keeps an ascending list of their post IDs. Records are readable
+// without locks once their ID has been handed out, except that text
+// restored from a snapshot changes place in ownContent(); appends for the
+// same author must be serialized by the caller.
+class PostStore {
+private:
+    static constexpr size_t ARENA_CHUNK_SIZE = 1 << 20;
+
+    // Each thread fills its own arena chunk, so appends by different authors
+    // only meet on the ID counter
+    struct ArenaCursor {
+        uint64_t storeSerial = 0;
+        char* chunk = nullptr;
+        size_t used = 0;
+    };
+
+    SegmentedVector<Post, 16> posts; // posts[id - 1]
+    SegmentedVector<vector<uint64_t>> byAuthor;
+    atomic<uint64_t> nextPostId;
+    uint64_t serial;
+    mutex chunkLock;
+    vector<unique_ptr<char[]>> chunks; // Owns every arena and oversized chunk
+
+    static ArenaCursor& cursor() {
+        thread_local ArenaCursor threadCursor;
+        return threadCursor;
+    }
+
+    char* allocateChunk(size_t size) {
+        lock_guard<mutex> guard(chunkLock);
+        chunks.emplace_back(new char[size]);
+        return chunks.back().get();
+    }
+
+    string_view storeContent(string_view content) {
+        char* destination;
+        ArenaCursor& arena = cursor();
+        if (content.size() > ARENA_CHUNK_SIZE) {
+            destination = allocateChunk(content.size());
+        }
+        else {
+            if (arena.storeSerial != serial || content.size() > ARENA_CHUNK_SIZE - arena.used) {
+                arena.storeSerial = serial;
+                arena.chunk = allocateChunk(ARENA_CHUNK_SIZE);
+                arena.used = 0;
+            }
+            destination = arena.chunk + arena.used;
+            arena.used += content.size();
+        }
+        memcpy(destination, content.data(), content.size());
+        return string_view(destination, content.size());
+    }
+
+public:
+    PostStore() : nextPostId(1) {
+        static atomic<uint64_t> serials(1);
+        serial = serials.fetch_add(1);
+    }
+
+    void addUser(int authorId) {
+        byAuthor.ensure(authorId);
+    }
+
+    uint64_t append(int authorId, const string& content, CustomTime timestamp) {
+        uint64_t postId = nextPostId.fetch_add(1);
+        posts.ensure(postId - 1) = Post{ postId, authorId, storeContent(content), timestamp };
+        byAuthor[authorId].push_back(postId);
+        return postId;
+    }
+
+    const Post& get(uint64_t postId) const {
+        return posts[postId - 1];
+    }
+
+    uint64_t size() const {
+        return nextPostId.load() - 1;
+    }
+
+    // Ascending IDs of the author's posts
+    const vector<uint64_t>& postsBy(int authorId) const {
+        return byAuthor[authorId];
+    }
+
+    // Copies into the arena the text of every post that points into
+    // [begin, end), so that memory can be released. The caller must keep
+    // readers of those posts' text out while this runs.
+    void ownContent(const char* begin, const char* end) {
+        uint64_t count = size();
+        for (uint64_t postId = 1; postId <= count; ++postId) {
+            Post& post = posts[postId - 1];
+            if (post.content.data() >= begin && post.content.data() < end) {
+                post.content = storeContent(post.content);
             }
         }
+    }
+
+    // Adds a post loaded from a snapshot. IDs must arrive in increasing
+    // order, and the content is not copied, so it must outlive the store
+    // or be handed to ownContent() first.
+    void restore(const Post& post) {
+        posts.ensure(post.id - 1) = post;
+        byAuthor[post.authorId].push_back(post.id);
+        nextPostId.store(post.id + 1);
+    }
+};
+
+// Full-text index over post content. A post's terms are its runs of letters
+// and digits, lowercased (bytes above 0x7F count as letters, so UTF-8 words
+// stay whole). Each term keeps an ascending list of post IDs, varint-encoded
+// in blocks of BLOCK_SIZE: a block's first ID is stored whole and the rest
+// as gaps, and one skip entry per block records its first ID and offset.
+// Queries AND their terms newest first, so a page of recent matches only
+// decodes a few blocks: the lists take turns lowering the candidate ID to
+// their next entry at or below it, found by galloping back over their skip
+// entries, until all of them agree. Terms are spread
+// over STRIPE_COUNT reader/writer locks. Writers hold one stripe at a time
+// and only wait for queries that use the same stripe.
+class PostIndex {
+public:
+    static constexpr size_t BLOCK_SIZE = 64;
+    static constexpr int STRIPE_COUNT = 64;
+    static constexpr size_t MAX_TERM_LENGTH = 64; // Longer terms are cut to this
+
+    struct Page {
+        vector<uint64_t> postIds; // Newest first
+        uint64_t nextCursor;      // Pass as 'before' for the next page, 0 when exhausted
+    };
+
+private:
+    struct Skip {
+        uint64_t firstId;
+        uint64_t offset; // Of the block's first byte
+    };
+
+    struct PostingList {
+        vector<uint8_t> bytes;
+        vector<Skip> skips; // One per block
+        uint64_t count = 0;
+        uint64_t lastId = 0;
+
+        void append(uint64_t postId) {
+            uint64_t value = postId - lastId;
+            if (count % BLOCK_SIZE == 0) {
+                skips.push_back(Skip{ postId, bytes.size() });
+                value = postId;
+            }
+            while (value >= 0x80) {
+                bytes.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            bytes.push_back(static_cast<uint8_t>(value));
+            lastId = postId;
+            ++count;
+        }
+
+        void decode(size_t block, vector<uint64_t>& ids) const {
+            size_t length = block + 1 < skips.size() ? BLOCK_SIZE : count - block * BLOCK_SIZE;
+            const uint8_t* in = bytes.data() + skips[block].offset;
+            uint64_t previous = 0;
+            ids.clear();
+            for (size_t i = 0; i < length; ++i) {
+                uint64_t value = 0;
+                for (int shift = 0;; shift += 7) {
+                    uint8_t byte = *in++;
+                    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                    if (byte < 0x80) {
+                        break;
+                    }
+                }
+                previous += value;
+                ids.push_back(previous);
+            }
+        }
+
+        // Last block whose first ID is at most postId, searching blocks
+        // [0, from] by galloping down from 'from'; -1 if there is none
+        long long blockAtOrBefore(uint64_t postId, size_t from) const {
+            if (skips.empty() || skips[0].firstId > postId) {
+                return -1;
+            }
+            size_t high = min(from, skips.size() - 1);
+            size_t low = high;
+            size_t step = 1;
+            while (skips[low].firstId > postId) {
+                high = low - 1;
+                low = low > step ? low - step : 0;
+                step *= 2;
+            }
+            while (low < high) {
+                size_t middle = low + (high - low + 1) / 2;
+                if (skips[middle].firstId <= postId) {
+                    low = middle;
+                }
+                else {
+                    high = middle - 1;
+                }
+            }
+            return static_cast<long long>(low);
+        }
+
+        // Adds an ID below lastId, which concurrent publishers can produce,
+        // by re-encoding from the block it belongs in
+        void insert(uint64_t postId) {
+            size_t block = static_cast<size_t>(max(0LL, blockAtOrBefore(postId, skips.size() - 1)));
+            vector<uint64_t> tail, ids;
+            for (size_t i = block; i < skips.size(); ++i) {
+                decode(i, ids);
+                tail.insert(tail.end(), ids.begin(), ids.end());
+            }
+            auto position = lower_bound(tail.begin(), tail.end(), postId);
+            if (position != tail.end() && *position == postId) {
+                return;
+            }
+            tail.insert(position, postId);
+            bytes.resize(skips[block].offset);
+            skips.resize(block);
+            count = block * BLOCK_SIZE;
+            for (uint64_t id : tail) {
+                append(id);
+            }
+        }
+    };
+
+    // Walks one posting list backwards, keeping its current block decoded
+    struct Cursor {
+        const PostingList* list;
+        size_t block;      // Where the next galloping search starts
+        long long decoded; // Block held in ids, -1 for none
+        vector<uint64_t> ids;
+
+        explicit Cursor(const PostingList* postingList) :
+            list(postingList), block(postingList->skips.size() - 1), decoded(-1) {}
+
+        // Largest ID in the list that is at most postId. Calls must not
+        // increase postId. Sets exhausted instead if there is none.
+        uint64_t floor(uint64_t postId, bool& exhausted) {
+            long long found = list->blockAtOrBefore(postId, block);
+            if (found < 0) {
+                exhausted = true;
+                return 0;
+            }
+            block = static_cast<size_t>(found);
+            if (decoded != found) {
+                list->decode(block, ids);
+                decoded = found;
+            }
+            return *(upper_bound(ids.begin(), ids.end(), postId) - 1);
+        }
+    };
+
+    struct Stripe {
+        shared_mutex lock;
+        unordered_map<string, PostingList> terms;
+    };
+
+    mutable Stripe stripes[STRIPE_COUNT];
+
+    static int stripeOf(const string& term) {
+        return static_cast<int>(((hash<string>()(term) * 0x9E3779B97F4A7C15ULL) >> 32) % STRIPE_COUNT);
+    }
+
+public:
+    // Distinct terms of text, sorted
+    static vector<string> termsOf(string_view text) {
+        vector<string> terms;
+        string term;
+        for (size_t i = 0; i <= text.size(); ++i) {
+            unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c >= 0x80) {
+                if (term.size() < MAX_TERM_LENGTH) {
+                    term += static_cast<char>(c);
+                }
+            }
+            else if (c >= 'A' && c <= 'Z') {
+                if (term.size() < MAX_TERM_LENGTH) {
+                    term += static_cast<char>(c - 'A' + 'a');
+                }
+            }
+            else if (!term.empty()) {
+                terms.push_back(std::move(term));
+                term.clear();
+            }
+        }
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+        return terms;
+    }
+
+    void add(uint64_t postId, string_view content) {
+        for (const string& term : termsOf(content)) {
+            Stripe& stripe = stripes[stripeOf(term)];
+            unique_lock<shared_mutex> guard(stripe.lock);
+            PostingList& list = stripe.terms[term];
+            if (list.count == 0 || postId > list.lastId) {
+                list.append(postId);
+            }
+            else {
+                list.insert(postId);
+            }
+        }
+    }
+
+    // Up to limit posts below 'before' (0 for the newest) that contain every
+    // term of query, newest first
+    Page search(const string& query, uint64_t before, int limit) const {
+        Page page;
+        page.nextCursor = 0;
+        vector<string> terms = termsOf(query);
+        if (terms.empty() || limit <= 0) {
+            return page;
+        }
+
+        // Shared locks on the terms' stripes, in ascending order
+        uint64_t mask = 0;
+        for (const string& term : terms) {
+            mask |= uint64_t(1) << stripeOf(term);
+        }
+        vector<shared_lock<shared_mutex>> guards;
+        for (int stripe = 0; stripe < STRIPE_COUNT; ++stripe) {
+            if (mask & (uint64_t(1) << stripe)) {
+                guards.emplace_back(stripes[stripe].lock);
+            }
+        }
+
+        vector<Cursor> cursors;
+        for (const string& term : terms) {
+            const Stripe& stripe = stripes[stripeOf(term)];
+            auto found = stripe.terms.find(term);
+            if (found == stripe.terms.end()) {
+                return page;
+            }
+            cursors.emplace_back(&found->second);
+        }
+        // The shortest list leads, so candidates drop fastest
+        sort(cursors.begin(), cursors.end(), [](const Cursor& a, const Cursor& b) {
+            return a.list->count < b.list->count;
+        });
+
+        // One match past the page tells whether there is a next page
+        uint64_t candidate = before == 0 ? UINT64_MAX : before - 1;
+        size_t agreed = 0;
+        bool exhausted = false;
+        for (size_t turn = 0; static_cast<int>(page.postIds.size()) <= limit; turn = (turn + 1) % cursors.size()) {
+            uint64_t lowered = cursors[turn].floor(candidate, exhausted);
+            if (exhausted) {
+                break;
+            }
+            if (lowered != candidate) {
+                candidate = lowered;
+                agreed = 0;
+            }
+            if (++agreed == cursors.size()) {
+                page.postIds.push_back(candidate--);
+                agreed = 0;
+            }
+        }
+        if (static_cast<int>(page.postIds.size()) > limit) {
+            page.postIds.pop_back();
+            page.nextCursor = page.postIds.back();
+        }
+        return page;
+    }
+};
+
+// Direct messages, one conversation per pair of users. A conversation is an
+// append-only log split into CHUNK_SIZE-message chunks, of which only the
+// newest RETAINED_CHUNKS are kept. Messages are numbered from 1 in the order
+// they were sent, and the numbers double as page cursors. Each side keeps
+// the number of the last message it has read and a running count of unread
+// messages from the other side, so listing an inbox never touches message
+// bodies. Conversations are spread over STRIPE_COUNT locks by user pair;
+// sends to different conversations rarely wait on each other.
+class MessageStore {
+public:
+    static constexpr size_t CHUNK_SIZE = 64;
+    static constexpr size_t RETAINED_CHUNKS = 16;
+    static constexpr int STRIPE_COUNT = 32;
+
+    struct Conversation {
+        int users[2];            // Ascending; equal for notes to oneself
+        uint64_t firstNumber;    // Number of chunks[0][0]; chunk-aligned
+        uint64_t lastNumber;     // Number of the newest message
+        uint64_t readThrough[2]; // Per side, the newest message it has seen
+        uint64_t unread[2];      // Per side, kept messages from the other side after readThrough
+        vector<vector<Message>> chunks;
+
+        int sideOf(int user) const {
+            return user == users[0] ? 0 : 1;
+        }
+
+        int partnerOf(int user) const {
+            return users[1 - sideOf(user)];
+        }
+
+        const Message& at(uint64_t number) const {
+            uint64_t index = number - firstNumber;
+            return chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+        }
+    };
+
+    // One line of an inbox
+    struct Summary {
+        int partnerId;
+        uint64_t unread;
+        uint64_t messageCount; // Including messages no longer kept
+        Message last;
+    };
+
+    struct PageEntry {
+        uint64_t number;
+        Message message;
+        bool unread;
+    };
+
+    struct Page {
+        vector<PageEntry> messages; // Newest first
+        uint64_t nextCursor;        // 'before' for the next older page; 0 if there is none
+    };
+
+private:
+    struct Stripe {
+        mutex lock;
+        unordered_map<uint64_t, unique_ptr<Conversation>> conversations;
+    };
+
+    struct UserConversations {
+        mutex lock;
+        vector<Conversation*> list;
+    };
+
+    // Lock order: a stripe, then user lists
+    mutable Stripe stripes[STRIPE_COUNT];
+    SegmentedVector<UserConversations> byUser;
+
+    static uint64_t keyOf(int user1, int user2) {
+        if (user1 > user2) {
+            swap(user1, user2);
+        }
+        return (static_cast<uint64_t>(static_cast<uint32_t>(user1)) << 32) | static_cast<uint32_t>(user2);
+    }
+
+    Stripe& stripeOf(uint64_t key) const {
+        return stripes[((key * 0x9E3779B97F4A7C15ULL) >> 32) % STRIPE_COUNT];
+    }
+
+    // Creates the conversation for key; the caller holds its stripe lock
+    Conversation& create(Stripe& stripe, uint64_t key, int user1, int user2) {
+        unique_ptr<Conversation>& slot = stripe.conversations[key];
+        slot.reset(new Conversation{ { min(user1, user2), max(user1, user2) }, 1, 0, { 0, 0 }, { 0, 0 }, {} });
+        auto listFor = [this, &slot](int user) {
+            lock_guard<mutex> guard(byUser[user].lock);
+            byUser[user].list.push_back(slot.get());
+        };
+        listFor(slot->users[0]);
+        if (slot->users[1] != slot->users[0]) {
+            listFor(slot->users[1]);
+        }
+        return *slot;
+    }
+
+    static void push(Conversation& conversation, Message message) {
+        if (conversation.chunks.empty() || conversation.chunks.back().size() == CHUNK_SIZE) {
+            if (conversation.chunks.size() == RETAINED_CHUNKS) {
+                dropOldestChunk(conversation);
+            }
+            conversation.chunks.emplace_back();
+            // A conversation reaching a second chunk is likely to keep going
+            if (conversation.chunks.size() > 1) {
+                conversation.chunks.back().reserve(CHUNK_SIZE);
+            }
+        }
+        conversation.chunks.back().push_back(std::move(message));
+        ++conversation.lastNumber;
+    }
+
+    static void dropOldestChunk(Conversation& conversation) {
+        for (size_t i = 0; i < CHUNK_SIZE; ++i) {
+            int recipient = conversation.partnerOf(conversation.chunks[0][i].senderId);
+            int side = conversation.sideOf(recipient);
+            if (recipient != conversation.chunks[0][i].senderId && conversation.firstNumber + i > conversation.readThrough[side]) {
+                --conversation.unread[side];
+            }
+        }
+        conversation.chunks.erase(conversation.chunks.begin());
+        conversation.firstNumber += CHUNK_SIZE;
+    }
+
+public:
+    void addUser(int userId) {
+        byUser.ensure(userId);
+    }
+
+    // Returns the message's number in its conversation. stored(number) runs
+    // once the message is in place, still under the conversation's stripe
+    // lock, so whatever it records follows the conversation's order.
+    template <typename Stored>
+    uint64_t append(int senderId, int recipientId, const string& content, CustomTime timestamp, Stored&& stored) {
+        uint64_t key = keyOf(senderId, recipientId);
+        Stripe& stripe = stripeOf(key);
+        lock_guard<mutex> guard(stripe.lock);
+        auto found = stripe.conversations.find(key);
+        Conversation& conversation = found != stripe.conversations.end() ? *found->second :
+            create(stripe, key, senderId, recipientId);
+        push(conversation, Message{ senderId, content, timestamp });
+        if (senderId != recipientId) {
+            ++conversation.unread[conversation.sideOf(recipientId)];
+        }
+        stored(conversation.lastNumber);
+        return conversation.lastNumber;
+    }
+
+    // Every conversation userId takes part in, most recent first
+    vector<Summary> inbox(int userId) const {
+        vector<Conversation*> conversations;
+        {
+            lock_guard<mutex> guard(byUser[userId].lock);
+            conversations = byUser[userId].list;
+        }
+        vector<Summary> summaries;
+        summaries.reserve(conversations.size());
+        for (const Conversation* conversation : conversations) {
+            lock_guard<mutex> guard(stripeOf(keyOf(conversation->users[0], conversation->users[1])).lock);
+            summaries.push_back(Summary{ conversation->partnerOf(userId), conversation->unread[conversation->sideOf(userId)],
+                conversation->lastNumber, conversation->at(conversation->lastNumber) });
+        }
+        sort(summaries.begin(), summaries.end(), [](const Summary& a, const Summary& b) {
+            if (!(a.last.timestamp == b.last.timestamp)) {
+                return b.last.timestamp < a.last.timestamp;
+            }
+            return a.partnerId < b.partnerId;
+        });
+        return summaries;
+    }
+
+    // Up to limit messages numbered below 'before' (0 for the newest), newest
+    // first, flagged unread as seen by readerId. Reading the newest page
+    // marks the whole conversation read for readerId.
+    Page read(int readerId, int partnerId, uint64_t before, int limit) {
+        Page page{ {}, 0 };
+        uint64_t key = keyOf(readerId, partnerId);
+        Stripe& stripe = stripeOf(key);
+        lock_guard<mutex> guard(stripe.lock);
+        auto found = stripe.conversations.find(key);
+        if (found == stripe.conversations.end()) {
+            return page;
+        }
+        Conversation& conversation = *found->second;
+        int side = conversation.sideOf(readerId);
+        uint64_t number = before == 0 || before > conversation.lastNumber ? conversation.lastNumber : before - 1;
+        for (; number >= conversation.firstNumber && static_cast<int>(page.messages.size()) < limit; --number) {
+            const Message& message = conversation.at(number);
+            page.messages.push_back(PageEntry{ number, message,
+                message.senderId != readerId && number > conversation.readThrough[side] });
+        }
+        if (!page.messages.empty() && number >= conversation.firstNumber) {
+            page.nextCursor = number + 1;
+        }
+        if (before == 0) {
+            conversation.readThrough[side] = conversation.lastNumber;
+            conversation.unread[side] = 0;
+        }
+        return page;
+    }
+
+    // Blocks every other use of the store while held
+    vector<unique_lock<mutex>> lockAll() const {
+        vector<unique_lock<mutex>> guards;
+        for (Stripe& stripe : stripes) {
+            guards.emplace_back(stripe.lock);
+        }
+        return guards;
+    }
+
+    // Every conversation, ordered by user pair. The caller holds lockAll().
+    vector<const Conversation*> conversations() const {
+        vector<const Conversation*> all;
+        for (const Stripe& stripe : stripes) {
+            for (const auto& entry : stripe.conversations) {
+                all.push_back(entry.second.get());
+            }
+        }
+        sort(all.begin(), all.end(), [](const Conversation* a, const Conversation* b) {
+            return keyOf(a->users[0], a->users[1]) < keyOf(b->users[0], b->users[1]);
+        });
+        return all;
+    }
+
+    // Adds a conversation loaded from a snapshot: its kept messages, oldest
+    // first, the first of which is numbered firstNumber. firstNumber must be
+    // chunk-aligned and messages non-empty and at most RETAINED_CHUNKS
+    // chunks long. Returns false if the pair already has a conversation.
+    bool restore(int user1, int user2, uint64_t firstNumber, const uint64_t readThrough[2], vector<Message> messages) {
+        uint64_t key = keyOf(user1, user2);
+        Stripe& stripe = stripeOf(key);
+        lock_guard<mutex> guard(stripe.lock);
+        if (stripe.conversations.count(key) != 0) {
+            return false;
+        }
+        Conversation& conversation = create(stripe, key, user1, user2);
+        conversation.firstNumber = firstNumber;
+        conversation.lastNumber = firstNumber - 1;
+        for (Message& message : messages) {
+            push(conversation, std::move(message));
+        }
+        for (int side = 0; side < 2; ++side) {
+            conversation.readThrough[side] = readThrough[side];
+        }
+        for (uint64_t number = firstNumber; number <= conversation.lastNumber; ++number) {
+            int sender = conversation.at(number).senderId;
+            int recipient = conversation.partnerOf(sender);
+            if (recipient != sender && number > conversation.readThrough[conversation.sideOf(recipient)]) {
+                ++conversation.unread[conversation.sideOf(recipient)];
+            }
+        }
+        return true;
+    }
+};
+
+// Newsfeed built with fan-out on write: every post ID is pushed into a
+// bounded inbox ring buffer of each follower. Authors with more than
+// CELEBRITY_FOLLOWERS followers skip the fan-out, and their posts are
+// merged into followers' feeds at read time with a k-way heap merge.
+// Post IDs increase with creation time, so they double as the feed order
+// and as pagination cursors.
+class NewsfeedService {
+public:
+    static constexpr int INBOX_CAPACITY = 256;
+    static constexpr int CELEBRITY_FOLLOWERS = 1000;
+
+    struct FeedPage {
+        vector<uint64_t> postIds; // Newest first
+        uint64_t nextCursor;      // Pass as 'before' for the next page, 0 when exhausted
+    };
+
+private:
+    static constexpr uint64_t NOT_CELEBRITY = UINT64_MAX;
+
+    // Ring buffer of the newest INBOX_CAPACITY post IDs, allocated on first use
+    struct Inbox {
+        vector<uint64_t> ring;
+        size_t head; // Slot of the next write
+        size_t count;
+
+        Inbox() : head(0), count(0) {}
+
+        size_t position(size_t i) const {
+            return (head + ring.size() - 1 - i) % ring.size();
+        }
+
+        // Keeps IDs sorted and unique; fan-outs from different authors can
+        // arrive slightly out of order, so the new ID sinks from the newest end
+        void push(uint64_t postId) {
+            if (ring.empty()) {
+                ring.resize(INBOX_CAPACITY);
+            }
+            size_t newer = 0;
+            while (newer < count && newest(newer) > postId) {
+                ++newer;
+            }
+            if ((newer < count && newest(newer) == postId) || (newer == count && count == ring.size())) {
+                return;
+            }
+            ring[head] = postId;
+            head = (head + 1) % ring.size();
+            count = min(count + 1, ring.size());
+            for (size_t i = 0; i < newer; ++i) {
+                swap(ring[position(i)], ring[position(i + 1)]);
+            }
+        }
+
+        // i = 0 is the newest entry
+        uint64_t newest(size_t i) const {
+            return ring[position(i)];
+        }
+
+        // Index of the newest entry older than 'before'
+        size_t firstBefore(uint64_t before) const {
+            size_t low = 0, high = count;
+            while (low < high) {
+                size_t mid = (low + high) / 2;
+                if (newest(mid) >= before) {
+                    low = mid + 1;
+                }
+                else {
+                    high = mid;
+                }
+            }
+            return low;
+        }
+    };
+
+    // Guarded by the owning user's shard lock
+    struct FeedState {
+        vector<int> followers;
+        vector<int> followedCelebrities;
+        uint64_t celebritySince; // First post ID that was not fanned out
+        Inbox inbox;
+
+        FeedState() : celebritySince(NOT_CELEBRITY) {}
+    };
+
+    const PostStore& posts;
+    SegmentedVector<FeedState> users;
+
+    // Merges author's fanned-out posts into a new follower's inbox
+    void backfill(int reader, int author) {
+        const vector<uint64_t>& source = posts.postsBy(author);
+        Inbox& inbox = users[reader].inbox;
+        vector<uint64_t> merged;
+        merged.reserve(inbox.count + min<size_t>(source.size(), INBOX_CAPACITY));
+        for (size_t i = inbox.count; i > 0; --i) {
+            merged.push_back(inbox.newest(i - 1));
+        }
+        size_t start = source.size() > INBOX_CAPACITY ? source.size() - INBOX_CAPACITY : 0;
+        for (size_t i = start; i < source.size() && source[i] < users[author].celebritySince; ++i) {
+            merged.push_back(source[i]);
+        }
+        sort(merged.begin(), merged.end());
+        merged.erase(unique(merged.begin(), merged.end()), merged.end());
+
+        inbox = Inbox();
+        size_t keep = merged.size() > INBOX_CAPACITY ? merged.size() - INBOX_CAPACITY : 0;
+        for (size_t i = keep; i < merged.size(); ++i) {
+            inbox.push(merged[i]);
+        }
+    }
+
+public:
+    NewsfeedService(const PostStore& postStore) : posts(postStore) {}
+
+    void addUser(int user) {
+        users.ensure(user);
+    }
+
+    bool isCelebrity(int author) const {
+        return users[author].celebritySince != NOT_CELEBRITY;
+    }
+
+    // Needs the follower's and the followee's shards
+    void onFollow(int follower, int followee) {
+        users[followee].followers.push_back(follower);
+        if (isCelebrity(followee)) {
+            users[follower].followedCelebrities.push_back(followee);
+        }
+        backfill(follower, followee);
+    }
+
+    // First half of publishing postId, under the author's shard. Returns the
+    // followers that must receive deliver() calls; newCelebrity is set when
+    // this post moved the author to fan-out on read.
+    vector<int> beginPublish(int author, uint64_t postId, bool& newCelebrity) {
+        FeedState& state = users[author];
+        newCelebrity = false;
+        if (!isCelebrity(author) && static_cast<int>(state.followers.size()) > CELEBRITY_FOLLOWERS) {
+            state.celebritySince = postId;
+            newCelebrity = true;
+        }
+        if (isCelebrity(author) && !newCelebrity) {
+            return vector<int>();
+        }
+        return state.followers;
+    }
+
+    // Second half of publishing, under the follower's shard
+    void deliver(int follower, int author, uint64_t postId, bool newCelebrity) {
+        FeedState& state = users[follower];
+        if (!newCelebrity) {
+            state.inbox.push(postId);
+        }
+        else if (find(state.followedCelebrities.begin(), state.followedCelebrities.end(), author) ==
+            state.followedCelebrities.end()) {
+            state.followedCelebrities.push_back(author);
+        }
+    }
+
+    // Feed state for snapshots; followers are the user's profile followers
+    const vector<int>& followedCelebritiesOf(int user) const {
+        return users[user].followedCelebrities;
+    }
+
+    uint64_t celebritySinceOf(int user) const {
+        return users[user].celebritySince;
+    }
+
+    // Inbox post IDs, oldest first
+    vector<uint64_t> inboxOf(int user) const {
+        const Inbox& inbox = users[user].inbox;
+        vector<uint64_t> postIds;
+        postIds.reserve(inbox.count);
+        for (size_t i = inbox.count; i > 0; --i) {
+            postIds.push_back(inbox.newest(i - 1));
+        }
+        return postIds;
+    }
+
+    // Sets the followers of a user who has never posted, as bulk imports do
+    void importFollowers(int user, vector<int> followers) {
+        users[user].followers = std::move(followers);
+    }
+
+    void restore(int user, vector<int> followers, vector<int> celebrities, uint64_t celebritySince,
+        const uint64_t* inboxPosts, size_t inboxCount) {
+        FeedState& state = users[user];
+        state.followers = std::move(followers);
+        state.followedCelebrities = std::move(celebrities);
+        state.celebritySince = celebritySince;
+        state.inbox = Inbox();
+        for (size_t i = 0; i < inboxCount; ++i) {
+            state.inbox.push(inboxPosts[i]);
+        }
+    }
+
+    // Newest posts older than 'before' (0 for the newest page)
+    FeedPage read(int reader, uint64_t before, int limit) const {
+        if (before == 0) {
+            before = UINT64_MAX;
+        }
+
+        // Each source is read newest-first; heap entries are (postId, source)
+        // where source -1 is the inbox and i >= 0 is followedCelebrities[i]
+        const Inbox& inbox = users[reader].inbox;
+        const vector<int>& celebrities = users[reader].followedCelebrities;
+        size_t inboxPos = inbox.firstBefore(before);
+        vector<size_t> remaining(celebrities.size());
+        priority_queue<pair<uint64_t, int>> heap;
+
+        if (inboxPos < inbox.count) {
+            heap.emplace(inbox.newest(inboxPos), -1);
+        }
+        for (size_t i = 0; i < celebrities.size(); ++i) {
+            const vector<uint64_t>& list = posts.postsBy(celebrities[i]);
+            auto lowest = lower_bound(list.begin(), list.end(), users[celebrities[i]].celebritySince);
+            auto end = lower_bound(lowest, list.end(), before);
+            remaining[i] = end - lowest;
+            if (remaining[i] > 0) {
+                heap.emplace(*(end - 1), static_cast<int>(i));
+            }
+        }
+
+        FeedPage page;
+        page.nextCursor = 0;
+        while (!heap.empty() && static_cast<int>(page.postIds.size()) < limit) {
+            pair<uint64_t, int> top = heap.top();
+            heap.pop();
+            page.postIds.push_back(top.first);
+
+            if (top.second < 0) {
+                if (++inboxPos < inbox.count) {
+                    heap.emplace(inbox.newest(inboxPos), -1);
+                }
+            }
+            else if (--remaining[top.second] > 0) {
+                const vector<uint64_t>& list = posts.postsBy(celebrities[top.second]);
+                auto lowest = lower_bound(list.begin(), list.end(), users[celebrities[top.second]].celebritySince);
+                heap.emplace(*(lowest + remaining[top.second] - 1), top.second);
+            }
+        }
+        if (!heap.empty()) {
+            page.nextCursor = page.postIds.back();
+        }
+        return page;
+    }
+};
+
+// Open-addressing hash index from username to user ID.
+// Slots hold the precomputed 64-bit hash next to the ID, so probing only
+// compares strings on a full hash match and no per-entry nodes are allocated.
+class UsernameIndex {
+private:
+    struct Slot {
+        uint64_t hash;
+        int id; // -1 marks an empty slot
+    };
+
+    vector<Slot> slots;
+    size_t count;
+
+    size_t mask() const {
+        return slots.size() - 1;
+    }
+
+    void grow() {
+        vector<Slot> old(slots.empty() ? 16 : slots.size() * 2, Slot{ 0, -1 });
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.id >= 0) {
+                size_t pos = slot.hash & mask();
+                while (slots[pos].id >= 0) {
+                    pos = (pos + 1) & mask();
+                }
+                slots[pos] = slot;
+            }
+        }
+    }
+
+public:
+    UsernameIndex() : count(0) {}
+
+    static uint64_t hashName(const string& name) {
+        // FNV-1a
+        uint64_t hash = 1469598103934665603ULL;
+        for (unsigned char ch : name) {
+            hash ^= ch;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void reserve(size_t entries) {
+        while (slots.size() * 7 < entries * 10) {
+            grow();
+        }
+    }
+
+    // nameOf(id) must return the username stored for an indexed ID
+    template <typename NameOf>
+    int find(const string& name, NameOf&& nameOf) const {
+        return find(name, hashName(name), nameOf);
+    }
+
+    template <typename NameOf>
+    int find(const string& name, uint64_t hash, NameOf&& nameOf) const {
+        if (slots.empty()) {
+            return -1;
+        }
+        for (size_t pos = hash & mask(); slots[pos].id >= 0; pos = (pos + 1) & mask()) {
+            if (slots[pos].hash == hash && nameOf(slots[pos].id) == name) {
+                return slots[pos].id;
+            }
+        }
+        return -1;
+    }
+
+    void insert(const string& name, int id) {
+        insert(hashName(name), id);
+    }
+
+    void insert(uint64_t hash, int id) {
+        if ((count + 1) * 10 > slots.size() * 7) {
+            grow();
+        }
+        size_t pos = hash & mask();
+        while (slots[pos].id >= 0) {
+            pos = (pos + 1) & mask();
+        }
+        slots[pos] = Slot{ hash, id };
+        ++count;
+    }
+};
+
+// Secondary index from city to the users who live there. Cities are matched
+// ignoring ASCII case and surrounding spaces and numbered as they are first
+// seen. Each city keeps its members as an ascending array of user IDs, which
+// stays sorted by appending because IDs are handed out in increasing order,
+// and each user's city number is kept for O(1) membership tests.
+class CityIndex {
+public:
+    static constexpr int NO_CITY = -1;
+
+private:
+    mutable shared_mutex lock;
+    unordered_map<string, int> numbers;
+    vector<vector<int>> members; // By city number
+    SegmentedVector<int> cityOfUser;
+
+    static string normalize(const string& city) {
+        size_t begin = city.find_first_not_of(" \t");
+        if (begin == string::npos) {
+            return string();
+        }
+        string key = city.substr(begin, city.find_last_not_of(" \t") + 1 - begin);
+        for (char& c : key) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+        }
+        return key;
+    }
+
+public:
+    // userId must be higher than every ID added before
+    void addUser(int userId, const string& city) {
+        string key = normalize(city);
+        int number = NO_CITY;
+        if (!key.empty()) {
+            unique_lock<shared_mutex> guard(lock);
+            auto inserted = numbers.emplace(std::move(key), static_cast<int>(members.size()));
+            if (inserted.second) {
+                members.emplace_back();
+            }
+            number = inserted.first->second;
+            members[number].push_back(userId);
+        }
+        cityOfUser.ensure(userId) = number;
+    }
+
+    // Readable without locks for any user whose registration is visible
+    int cityOf(int userId) const {
+        return cityOfUser[userId];
+    }
+
+    // Calls fn(city number, ascending member IDs) under a shared lock and
+    // returns true, or returns false if nobody lives in city
+    template <typename Fn>
+    bool withMembers(const string& city, Fn&& fn) const {
+        string key = normalize(city);
+        shared_lock<shared_mutex> guard(lock);
+        auto found = numbers.find(key);
+        if (found == numbers.end()) {
+            return false;
+        }
+        fn(found->second, members[found->second]);
+        return true;
+    }
+};
+
+// On-disk snapshot layout. A header and a section table are followed by
+// flat sections, each starting on an 8-byte boundary. All strings live in one
+// blob that records refer to by offset, so a loader can map the file and use
+// it in place. Per-user lists are stored as a data section plus an index of
+// userCount + 1 offsets into it; messages are listed the same way per
+// conversation. Integers are in host byte order, which the
+// header records.
+struct SnapshotFormat {
+    static constexpr char MAGIC[8] = { 'S', 'N', 'S', 'N', 'A', 'P', '\0', '\0' };
+    static constexpr uint32_t VERSION = 4;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static constexpr uint32_t MAX_SECTIONS = 64;
+
+    enum SectionKind : uint32_t {
+        STRINGS = 1,
+        USERS,
+        POSTS,
+        ADJACENCY_OFFSETS,   // One per adjacency shard, index = shard
+        ADJACENCY_NEIGHBORS,
+        FOLLOWERS_INDEX,
+        FOLLOWERS,
+        FOLLOWING_INDEX,
+        FOLLOWING,
+        PENDING_INDEX,
+        PENDING,
+        CELEBRITIES_INDEX,
+        CELEBRITIES,
+        INBOX_INDEX,
+        INBOX,
+        MESSAGES_INDEX,      // One list per CONVERSATIONS record
+        MESSAGES,
+        NOTIFICATIONS_INDEX,
+        NOTIFICATIONS,
+        META,
+        NOTIFICATION_ACTORS_INDEX, // Actors of each open notification, in record order
+        NOTIFICATION_ACTORS,
+        CONVERSATIONS
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrderMark;
+        uint32_t sectionCount;
+        uint32_t reserved;
+    };
+
+    struct Section {
+        uint32_t kind;
+        uint32_t index;
+        uint64_t offset;
+        uint64_t size; // Bytes
+    };
+
+    struct StringRef {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct TimeRecord {
+        int64_t microseconds; // Since the Unix epoch, UTC
+    };
+
+    struct UserRecord {
+        StringRef name, password, securityQuestion, securityAnswer, city;
+        TimeRecord lastLogin;
+        uint64_t celebritySince;
+        uint32_t unreadNotifications; // The newest this many notifications are unread
+        uint32_t reserved;
+    };
+
+    struct PostRecord {
+        uint64_t id;
+        int32_t authorId;
+        uint32_t reserved;
+        StringRef content;
+        TimeRecord timestamp;
+    };
+
+    struct ConversationRecord {
+        int32_t users[2];        // Ascending
+        uint64_t firstNumber;    // Number of its first kept message
+        uint64_t readThrough[2]; // Per user, the newest message they have read
+    };
+
+    struct MessageRecord {
+        int32_t senderId;
+        uint32_t reserved;
+        StringRef content;
+        TimeRecord timestamp;
+    };
+
+    struct NotificationRecord {
+        uint16_t type;
+        uint16_t open; // Still merging; its actorCount actors are in NOTIFICATION_ACTORS
+        int32_t actorId;
+        uint64_t objectId;
+        uint32_t eventCount;
+        uint32_t actorCount;
+        TimeRecord timestamp;
+    };
+
+    // Exactly one per snapshot
+    struct MetaRecord {
+        uint64_t logSequence; // Last log record the snapshot includes
+    };
+
+    static TimeRecord toRecord(const CustomTime& time) {
+        return TimeRecord{ time.microseconds };
+    }
+
+    static CustomTime fromRecord(const TimeRecord& record) {
+        return CustomTime{ record.microseconds };
+    }
+};
+
+static_assert(sizeof(SnapshotFormat::Header) == 24, "Snapshot header layout changed");
+static_assert(sizeof(SnapshotFormat::Section) == 24, "Snapshot section layout changed");
+static_assert(sizeof(SnapshotFormat::UserRecord) == 104, "Snapshot user record layout changed");
+static_assert(sizeof(SnapshotFormat::PostRecord) == 40, "Snapshot post record layout changed");
+static_assert(sizeof(SnapshotFormat::ConversationRecord) == 32, "Snapshot conversation record layout changed");
+static_assert(sizeof(SnapshotFormat::MessageRecord) == 32, "Snapshot message record layout changed");
+static_assert(sizeof(SnapshotFormat::NotificationRecord) == 32, "Snapshot notification record layout changed");
+
+// Unbuffered file access for data that must be on disk before we rely on
+// it: writes go straight to the descriptor and sync() forces them out
+struct DurableIo {
+    static int openReadWrite(const string& path) {
+#ifdef _WIN32
+        int descriptor = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int descriptor = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+        if (descriptor < 0) {
+            throw runtime_error("Cannot open " + path);
+        }
+        return descriptor;
+    }
+
+    static void writeAll(int descriptor, const char* data, size_t size) {
+        while (size > 0) {
+#ifdef _WIN32
+            int written = _write(descriptor, data, static_cast<unsigned>(min<size_t>(size, 1 << 30)));
+#else
+            ssize_t written = write(descriptor, data, size);
+#endif
+            if (written <= 0) {
+                throw runtime_error("File write failed");
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    static void sync(int descriptor) {
+#ifdef _WIN32
+        int result = _commit(descriptor);
+#else
+        int result = fsync(descriptor);
+#endif
+        if (result != 0) {
+            throw runtime_error("File sync failed");
+        }
+    }
+
+    // Cuts the file to size and moves the write position to its end
+    static void truncate(int descriptor, uint64_t size) {
+#ifdef _WIN32
+        bool failed = _chsize_s(descriptor, static_cast<long long>(size)) != 0 ||
+            _lseeki64(descriptor, static_cast<long long>(size), SEEK_SET) < 0;
+#else
+        bool failed = ftruncate(descriptor, static_cast<off_t>(size)) != 0 ||
+            lseek(descriptor, static_cast<off_t>(size), SEEK_SET) < 0;
+#endif
+        if (failed) {
+            throw runtime_error("File truncate failed");
+        }
+    }
+
+    static void closeFile(int descriptor) {
+#ifdef _WIN32
+        _close(descriptor);
+#else
+        close(descriptor);
+#endif
+    }
+
+    static void syncPath(const string& path) {
+        int descriptor = openReadWrite(path);
+        try {
+            sync(descriptor);
+        }
+        catch (...) {
+            closeFile(descriptor);
+            throw;
+        }
+        closeFile(descriptor);
+    }
+
+    // Moves from over to, replacing it, and makes the new directory entry
+    // durable before returning
+    static void replaceFile(const string& from, const string& to) {
+#ifdef _WIN32
+        if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            throw runtime_error("Cannot replace " + to);
+        }
+#else
+        if (rename(from.c_str(), to.c_str()) != 0) {
+            throw runtime_error("Cannot replace " + to);
+        }
+        size_t slash = to.find_last_of('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : to.substr(0, slash);
+        int descriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (descriptor < 0) {
+            throw runtime_error("Cannot open " + directory);
+        }
+        try {
+            sync(descriptor);
+        }
+        catch (...) {
+            closeFile(descriptor);
+            throw;
+        }
+        closeFile(descriptor);
+#endif
+    }
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    const char* base;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+public:
+    explicit MappedFile(const string& path) : base(nullptr), length(0) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw runtime_error("Cannot open " + path);
+        }
+        LARGE_INTEGER fileSize;
+        mapping = nullptr;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        if (mapping) {
+            base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+        if (!base) {
+            if (mapping) {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file);
+            throw runtime_error("Cannot map " + path);
+        }
+        length = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            throw runtime_error("Cannot open " + path);
+        }
+        struct stat info;
+        void* mapped = MAP_FAILED;
+        if (fstat(descriptor, &info) == 0 && info.st_size > 0) {
+            length = static_cast<size_t>(info.st_size);
+            mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        }
+        close(descriptor);
+        if (mapped == MAP_FAILED) {
+            throw runtime_error("Cannot map " + path);
+        }
+        base = static_cast<const char*>(mapped);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap(const_cast<char*>(base), length);
+#endif
+    }
+
+    const char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+// Streams sections to a snapshot file. Space for the header and section
+// table is reserved up front and filled in by finish().
+class SnapshotWriter {
+private:
+    ofstream out;
+    string path;
+    vector<SnapshotFormat::Section> sections;
+    uint64_t position;
+
+    static constexpr uint64_t TABLE_END =
+        sizeof(SnapshotFormat::Header) + SnapshotFormat::MAX_SECTIONS * sizeof(SnapshotFormat::Section);
+
+public:
+    explicit SnapshotWriter(const string& filePath) : out(filePath, ios::binary | ios::trunc), path(filePath), position(0) {
+        if (!out) {
+            throw runtime_error("Cannot create " + path);
+        }
+        string reserved(TABLE_END, '\0');
+        write(reserved.data(), reserved.size());
+    }
+
+    void write(const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+        position += size;
+    }
+
+    void beginSection(uint32_t kind, uint32_t index = 0) {
+        if (sections.size() == SnapshotFormat::MAX_SECTIONS) {
+            throw runtime_error("Too many snapshot sections");
+        }
+        static const char padding[8] = {};
+        write(padding, (8 - position % 8) % 8);
+        sections.push_back(SnapshotFormat::Section{ kind, index, position, 0 });
+    }
+
+    void endSection() {
+        sections.back().size = position - sections.back().offset;
+    }
+
+    void writeSection(uint32_t kind, uint32_t index, const void* data, size_t size) {
+        beginSection(kind, index);
+        write(data, size);
+        endSection();
+    }
+
+    // Writes listCount lists of Record plus their offset index. fill(i, emit)
+    // calls emit(record) for every record of list i.
+    template <typename Record, typename Fill>
+    void writeLists(uint32_t indexKind, uint32_t dataKind, size_t listCount, Fill&& fill) {
+        vector<uint64_t> index;
+        index.reserve(listCount + 1);
+        uint64_t written = 0;
+        beginSection(dataKind);
+        for (size_t i = 0; i < listCount; ++i) {
+            index.push_back(written);
+            fill(i, [&](const Record& record) {
+                write(&record, sizeof(record));
+                ++written;
+            });
+        }
+        index.push_back(written);
+        endSection();
+        writeSection(indexKind, 0, index.data(), index.size() * sizeof(uint64_t));
+    }
+
+    void finish() {
+        SnapshotFormat::Header header;
+        memcpy(header.magic, SnapshotFormat::MAGIC, sizeof(header.magic));
+        header.version = SnapshotFormat::VERSION;
+        header.byteOrderMark = SnapshotFormat::BYTE_ORDER_MARK;
+        header.sectionCount = static_cast<uint32_t>(sections.size());
+        header.reserved = 0;
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(SnapshotFormat::Section));
+        out.flush();
+        if (!out) {
+            throw runtime_error("Failed to write " + path);
+        }
+        out.close();
+    }
+};
+
+// Validating view over a mapped snapshot. Every accessor checks bounds, so a
+// truncated or corrupt file fails with an exception instead of bad reads.
+class SnapshotReader {
+private:
+    const char* base;
+    size_t size;
+    const SnapshotFormat::Section* table;
+    uint32_t sectionCount;
+    const char* strings;
+    uint64_t stringsSize;
+
+    static void corrupt(const string& detail) {
+        throw runtime_error("Corrupt snapshot: " + detail);
+    }
+
+public:
+    explicit SnapshotReader(const MappedFile& file) : base(file.data()), size(file.size()) {
+        if (size < sizeof(SnapshotFormat::Header)) {
+            corrupt("file too small");
+        }
+        const SnapshotFormat::Header* header = reinterpret_cast<const SnapshotFormat::Header*>(base);
+        if (memcmp(header->magic, SnapshotFormat::MAGIC, sizeof(header->magic)) != 0) {
+            corrupt("bad magic");
+        }
+        if (header->byteOrderMark != SnapshotFormat::BYTE_ORDER_MARK) {
+            corrupt("written on a machine with a different byte order");
+        }
+        if (header->version != SnapshotFormat::VERSION) {
+            throw runtime_error("Unsupported snapshot version " + to_string(header->version));
+        }
+        sectionCount = header->sectionCount;
+        if (sectionCount > SnapshotFormat::MAX_SECTIONS ||
+            sizeof(SnapshotFormat::Header) + sectionCount * sizeof(SnapshotFormat::Section) > size) {
+            corrupt("bad section table");
+        }
+        table = reinterpret_cast<const SnapshotFormat::Section*>(base + sizeof(SnapshotFormat::Header));
+        for (uint32_t i = 0; i < sectionCount; ++i) {
+            if (table[i].offset % 8 != 0 || table[i].offset > size || table[i].size > size - table[i].offset) {
+                corrupt("section out of bounds");
+            }
+        }
+        size_t stringCount;
+        strings = array<char>(SnapshotFormat::STRINGS, 0, stringCount);
+        stringsSize = stringCount;
+    }
+
+    // Returns nullptr if the section is absent
+    template <typename T>
+    const T* findArray(uint32_t kind, uint32_t index, size_t& count) const {
+        for (uint32_t i = 0; i < sectionCount; ++i) {
+            if (table[i].kind == kind && table[i].index == index) {
+                if (table[i].size % sizeof(T) != 0) {
+                    corrupt("section " + to_string(kind) + " has a partial record");
+                }
+                count = table[i].size / sizeof(T);
+                return reinterpret_cast<const T*>(base + table[i].offset);
+            }
+        }
+        count = 0;
+        return nullptr;
+    }
+
+    template <typename T>
+    const T* array(uint32_t kind, uint32_t index, size_t& count) const {
+        const T* data = findArray<T>(kind, index, count);
+        if (!data) {
+            corrupt("missing section " + to_string(kind));
+        }
+        return data;
+    }
+
+    string_view text(const SnapshotFormat::StringRef& ref) const {
+        if (ref.offset > stringsSize || ref.length > stringsSize - ref.offset) {
+            corrupt("string out of bounds");
+        }
+        return string_view(strings + ref.offset, ref.length);
+    }
+
+    // One list per user, stored as an offset index plus a data section
+    template <typename T>
+    class Lists {
+    private:
+        const uint64_t* index;
+        const T* data;
+        size_t dataCount;
+
+    public:
+        Lists(const SnapshotReader& reader, uint32_t indexKind, uint32_t dataKind, size_t listCount) {
+            size_t indexCount;
+            index = reader.array<uint64_t>(indexKind, 0, indexCount);
+            data = reader.array<T>(dataKind, 0, dataCount);
+            if (indexCount != listCount + 1) {
+                corrupt("list index " + to_string(indexKind) + " has the wrong length");
+            }
+        }
+
+        const T* items(size_t list, size_t& count) const {
+            if (index[list] > index[list + 1] || index[list + 1] > dataCount) {
+                corrupt("list out of bounds");
+            }
+            count = index[list + 1] - index[list];
+            return data + index[list];
+        }
+    };
+};
+
+// Raised when a logged mutation could not be made durable. The change is
+// already applied in memory, so the process must stop without saving it.
+class StorageFailure : public runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+// Append-only write-ahead log of graph mutations. Every record is framed
+// with its length and a CRC-32, and record n (counting from the base
+// sequence in the header) has sequence number base + n. Appends only copy
+// into a shared buffer; durability comes from group commit: the first
+// waiter becomes the leader, writes and syncs everything buffered so far,
+// and wakes every waiter the sync covered, so a burst of writers shares one
+// fsync. A checkpoint writes a snapshot that includes every record so far
+// and starts an empty log whose base is the last sequence.
+class WriteAheadLog {
+public:
+    enum RecordType : uint8_t {
+        ADD_USER = 1,
+        FOLLOW_REQUEST,
+        ACCEPT_REQUEST,
+        CREATE_POST,
+        SEND_MESSAGE,
+        RESET_PASSWORD,
+        REJECT_REQUEST,
+        ACCEPT_ALL_REQUESTS
+    };
+
+    // Serializes one record: type, timestamp, then IDs and length-prefixed
+    // strings in the order the caller adds them
+    class RecordBuilder {
+    private:
+        string bytes;
+
+        void put32(uint32_t value) {
+            bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+    public:
+        RecordBuilder(RecordType type, const CustomTime& time) {
+            bytes.push_back(static_cast<char>(type));
+            bytes.append(reinterpret_cast<const char*>(&time.microseconds), sizeof(time.microseconds));
+        }
+
+        RecordBuilder& id(int value) {
+            put32(static_cast<uint32_t>(value));
+            return *this;
+        }
+
+        RecordBuilder& number(uint64_t value) {
+            bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return *this;
+        }
+
+        RecordBuilder& text(const string& value) {
+            put32(static_cast<uint32_t>(value.size()));
+            bytes.append(value);
+            return *this;
+        }
+
+        const string& data() const {
+            return bytes;
+        }
+    };
+
+    // Reads the fields of one record back in the order they were built
+    class RecordReader {
+    private:
+        const char* cursor;
+        const char* end;
+
+        uint32_t get32() {
+            uint32_t value;
+            take(&value, sizeof(value));
+            return value;
+        }
+
+        void take(void* destination, size_t size) {
+            if (static_cast<size_t>(end - cursor) < size) {
+                throw runtime_error("Corrupt log: record too short");
+            }
+            memcpy(destination, cursor, size);
+            cursor += size;
+        }
+
+    public:
+        RecordType type;
+        CustomTime time;
+
+        RecordReader(const char* data, size_t size) : cursor(data), end(data + size) {
+            uint8_t rawType;
+            take(&rawType, 1);
+            type = static_cast<RecordType>(rawType);
+            take(&time.microseconds, sizeof(time.microseconds));
+        }
+
+        int id() {
+            return static_cast<int>(get32());
+        }
+
+        uint64_t number() {
+            uint64_t value;
+            take(&value, sizeof(value));
+            return value;
+        }
+
+        string text() {
+            uint32_t length = get32();
+            if (static_cast<size_t>(end - cursor) < length) {
+                throw runtime_error("Corrupt log: string too long");
+            }
+            string value(cursor, length);
+            cursor += length;
+            return value;
+        }
+    };
+
+private:
+    static constexpr char MAGIC[8] = { 'S', 'N', 'W', 'A', 'L', '\0', '\0', '\0' };
+    static constexpr uint32_t VERSION = 3;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t baseSequence;
+    };
+
+    struct Frame {
+        uint32_t length;
+        uint32_t checksum;
+    };
+
+    mutex lock;
+    condition_variable committed;
+    int descriptor;
+    string pending;            // Framed records not yet written
+    uint64_t appendedSequence; // Last sequence handed out
+    uint64_t durableSequence;  // Last sequence known to be on disk
+    bool flushing;             // A leader is writing outside the lock
+    // Set when a flush fails. Records after durableSequence may be partly
+    // on disk or not at all, so none of them can be reported durable until
+    // a checkpoint covers them.
+    exception_ptr failure;
+
+    static uint32_t crc32(const char* data, size_t size) {
+        static const vector<uint32_t> table = [] {
+            vector<uint32_t> entries(256);
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+                }
+                entries[i] = value;
+            }
+            return entries;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    // Empties the file and writes a header for a log starting after base
+    void reset(uint64_t base) {
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.reserved = 0;
+        header.baseSequence = base;
+        DurableIo::truncate(descriptor, 0);
+        DurableIo::writeAll(descriptor, reinterpret_cast<const char*>(&header), sizeof(header));
+        DurableIo::sync(descriptor);
+        appendedSequence = durableSequence = base;
+    }
+
+public:
+    // Opens or creates the log at path. Records after skipThrough (the
+    // sequence the loaded snapshot already includes) are passed to apply in
+    // order. A torn or corrupt tail left by a crash is cut off.
+    template <typename Apply>
+    WriteAheadLog(const string& path, uint64_t skipThrough, Apply&& apply) :
+        descriptor(-1), appendedSequence(0), durableSequence(0), flushing(false) {
+        string contents;
+        {
+            ifstream input(path, ios::binary);
+            contents.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+        }
+        descriptor = DurableIo::openReadWrite(path);
+
+        Header header;
+        if (contents.size() < sizeof(header)) {
+            reset(skipThrough);
+            return;
+        }
+        memcpy(&header, contents.data(), sizeof(header));
+        if (memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.version != VERSION) {
+            DurableIo::closeFile(descriptor);
+            throw runtime_error("Unsupported or corrupt log " + path);
+        }
+        if (header.baseSequence > skipThrough) {
+            DurableIo::closeFile(descriptor);
+            throw runtime_error("Log " + path + " starts after the snapshot; records are missing");
+        }
+
+        size_t offset = sizeof(header);
+        uint64_t sequence = header.baseSequence;
+        while (contents.size() - offset >= sizeof(Frame)) {
+            Frame frame;
+            memcpy(&frame, contents.data() + offset, sizeof(frame));
+            const char* payload = contents.data() + offset + sizeof(frame);
+            if (frame.length > contents.size() - offset - sizeof(frame) || crc32(payload, frame.length) != frame.checksum) {
+                break;
+            }
+            if (++sequence > skipThrough) {
+                RecordReader record(payload, frame.length);
+                apply(record);
+            }
+            offset += sizeof(frame) + frame.length;
+        }
+
+        if (sequence < skipThrough) {
+            // The snapshot is newer than everything logged here
+            reset(skipThrough);
+            return;
+        }
+        DurableIo::truncate(descriptor, offset);
+        appendedSequence = durableSequence = sequence;
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        try {
+            waitDurable(appendedSequence);
+        }
+        catch (const exception&) {
+        }
+        DurableIo::closeFile(descriptor);
+    }
+
+    // Buffers a record and returns its sequence number. The log lock only
+    // covers the copy into the buffer; callers append while holding the
+    // locks of the state they changed, which orders conflicting records.
+    uint64_t append(const string& record) {
+        Frame frame{ static_cast<uint32_t>(record.size()), crc32(record.data(), record.size()) };
+        lock_guard<mutex> guard(lock);
+        pending.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+        pending.append(record);
+        return ++appendedSequence;
+    }
+
+    // Blocks until the record with this sequence number is on disk. Throws
+    // if a flush failed before the record was known to be durable.
+    void waitDurable(uint64_t sequence) {
+        unique_lock<mutex> guard(lock);
+        while (durableSequence < sequence) {
+            if (failure) {
+                rethrow_exception(failure);
+            }
+            if (flushing) {
+                committed.wait(guard);
+                continue;
+            }
+
+            // Become the leader for everything buffered so far
+            flushing = true;
+            string batch;
+            batch.swap(pending);
+            uint64_t target = appendedSequence;
+            guard.unlock();
+            try {
+                DurableIo::writeAll(descriptor, batch.data(), batch.size());
+                DurableIo::sync(descriptor);
+            }
+            catch (...) {
+                guard.lock();
+                failure = current_exception();
+                flushing = false;
+                committed.notify_all();
+                throw;
+            }
+            guard.lock();
+            durableSequence = target;
+            flushing = false;
+            committed.notify_all();
+        }
+    }
+
+    // Runs writeSnapshot(sequence) with appends blocked, where sequence is
+    // the last record the snapshot must include, then starts a new log. The
+    // snapshot makes every record durable, which clears a failed flush.
+    template <typename WriteSnapshot>
+    void checkpoint(WriteSnapshot&& writeSnapshot) {
+        unique_lock<mutex> guard(lock);
+        committed.wait(guard, [this] { return !flushing; });
+        writeSnapshot(appendedSequence);
+        pending.clear();
+        reset(appendedSequence);
+        failure = nullptr;
+        committed.notify_all();
+    }
+};
+
+// Streams a text file in CHUNK_SIZE blocks and parses the complete lines of
+// each block on several threads while the calling thread reads the next
+// block. Blank lines and lines starting with '#' are skipped; '\r' before a
+// newline is dropped. Used by bulk imports, whose dumps are far too large to
+// read in one piece or parse on one core.
+class ParallelLineScanner {
+public:
+    static constexpr size_t CHUNK_SIZE = 16 << 20;
+
+    static int defaultThreads() {
+        return static_cast<int>(max(1u, thread::hardware_concurrency()));
+    }
+
+    // Runs fn(begin, end) over [0, count) split into one contiguous range per thread
+    template <typename Fn>
+    static void parallelFor(int threads, size_t count, Fn&& fn) {
+        size_t workers = max<size_t>(1, min<size_t>(threads, count));
+        size_t chunk = (count + workers - 1) / max<size_t>(1, workers);
+        vector<thread> pool;
+        for (size_t t = 1; t < workers; ++t) {
+            size_t begin = min(count, chunk * t);
+            size_t end = min(count, begin + chunk);
+            pool.emplace_back([&fn, begin, end]() { fn(begin, end); });
+        }
+        fn(0, min(count, chunk));
+        for (thread& worker : pool) {
+            worker.join();
+        }
+    }
+
+    // Splits one CSV line into fields; fields may be double-quoted, with ""
+    // standing for a quote. Returns false on an unterminated quote.
+    static bool splitCsv(const char* begin, const char* end, vector<string>& fields) {
+        fields.clear();
+        const char* at = begin;
+        while (true) {
+            string field;
+            if (at < end && *at == '"') {
+                for (++at; ; ++at) {
+                    if (at == end) {
+                        return false;
+                    }
+                    if (*at == '"') {
+                        if (at + 1 < end && at[1] == '"') {
+                            ++at;
+                        }
+                        else {
+                            ++at;
+                            break;
+                        }
+                    }
+                    field += *at;
+                }
+            }
+            const char* stop = find(at, end, ',');
+            field.append(at, stop);
+            fields.push_back(std::move(field));
+            if (stop == end) {
+                return true;
+            }
+            at = stop + 1;
+        }
+    }
+
+    // parseLine(worker, begin, end) handles one line on worker thread
+    // 'worker' and returns nullptr or an error message; after each block,
+    // merge(worker) runs for every worker in file order on the calling
+    // thread. Throws runtime_error naming the first bad line.
+    template <typename ParseLine, typename Merge>
+    static void scan(const string& path, int threads, ParseLine&& parseLine, Merge&& merge) {
+        ifstream in(path, ios::binary);
+        if (!in) {
+            throw runtime_error("Cannot open " + path);
+        }
+
+        struct Slice {
+            size_t lines = 0;
+            size_t failedLine = 0; // 1-based within the slice, 0 if none
+            const char* error = nullptr;
+        };
+
+        threads = max(1, threads);
+        vector<char> current, next;
+        size_t lineBase = 0;
+        auto fill = [&in](vector<char>& buffer, size_t keep) {
+            buffer.resize(keep + CHUNK_SIZE);
+            in.read(buffer.data() + keep, CHUNK_SIZE);
+            buffer.resize(keep + static_cast<size_t>(in.gcount()));
+        };
+        fill(current, 0);
+
+        while (!current.empty()) {
+            bool last = !in;
+            size_t end = current.size();
+            if (!last) {
+                // Hold back the partial last line; a line longer than a
+                // whole block just makes the next block bigger
+                while (end > 0 && current[end - 1] != '\n') {
+                    --end;
+                }
+            }
+            next.assign(current.begin() + end, current.end());
+
+            // Slices end on line boundaries
+            vector<size_t> bounds{ 0 };
+            for (int t = 1; t < threads; ++t) {
+                size_t cut = max(bounds.back(), end * t / threads);
+                while (cut > bounds.back() && cut < end && current[cut - 1] != '\n') {
+                    ++cut;
+                }
+                bounds.push_back(cut);
+            }
+            bounds.push_back(end);
+
+            vector<Slice> slices(threads);
+            auto parseSlice = [&](int worker) {
+                const char* at = current.data() + bounds[worker];
+                const char* stop = current.data() + bounds[worker + 1];
+                Slice& slice = slices[worker];
+                while (at < stop) {
+                    const char* lineEnd = static_cast<const char*>(memchr(at, '\n', stop - at));
+                    const char* following = lineEnd ? lineEnd + 1 : stop;
+                    lineEnd = lineEnd ? lineEnd : stop;
+                    if (lineEnd > at && lineEnd[-1] == '\r') {
+                        --lineEnd;
+                    }
+                    ++slice.lines;
+                    if (lineEnd > at && *at != '#') {
+                        const char* error = parseLine(worker, at, lineEnd);
+                        if (error) {
+                            slice.failedLine = slice.lines;
+                            slice.error = error;
+                            return;
+                        }
+                    }
+                    at = following;
+                }
+            };
+            vector<thread> pool;
+            for (int t = 0; t < threads; ++t) {
+                pool.emplace_back(parseSlice, t);
+            }
+            if (!last) {
+                fill(next, next.size());
+            }
+            else {
+                next.clear();
+            }
+            for (thread& worker : pool) {
+                worker.join();
+            }
+
+            for (const Slice& slice : slices) {
+                if (slice.error) {
+                    throw runtime_error(path + ":" + to_string(lineBase + slice.failedLine) + ": " + slice.error);
+                }
+                lineBase += slice.lines;
+            }
+            for (int t = 0; t < threads; ++t) {
+                merge(t);
+            }
+            current.swap(next);
+        }
+    }
+};
+
+// Set of user IDs in a linear-probing table kept at most half full, so
+// adding and finding an ID are O(1). IDs are never removed.
+class IdSet {
+private:
+    vector<int> slots; // -1 marks an empty slot
+    size_t live;
+
+    size_t mask() const {
+        return slots.size() - 1;
+    }
+
+    // Slot holding id, or the empty slot where it would go
+    size_t probe(int id) const {
+        size_t pos = static_cast<size_t>((static_cast<uint64_t>(id) * 0x9E3779B97F4A7C15ULL) >> 32) & mask();
+        while (slots[pos] >= 0 && slots[pos] != id) {
+            pos = (pos + 1) & mask();
+        }
+        return pos;
+    }
+
+    void rehash(size_t capacity) {
+        vector<int> old(capacity, -1);
+        old.swap(slots);
+        for (int id : old) {
+            if (id >= 0) {
+                slots[probe(id)] = id;
+            }
+        }
+    }
+
+public:
+    IdSet() : live(0) {}
+
+    size_t size() const {
+        return live;
+    }
+
+    bool contains(int id) const {
+        return !slots.empty() && slots[probe(id)] == id;
+    }
+
+    // Sizes the table for count IDs up front
+    void reserve(size_t count) {
+        size_t capacity = 16;
+        while (capacity < count * 2) {
+            capacity *= 2;
+        }
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    // Returns false if id was already present
+    bool add(int id) {
+        if (contains(id)) {
+            return false;
+        }
+        if ((live + 1) * 2 > slots.size()) {
+            rehash(max<size_t>(16, slots.size() * 2));
+        }
+        slots[probe(id)] = id;
+        ++live;
+        return true;
+    }
+};
+
+// Pending follow requests to one user, keyed by requester ID. Requests stay
+// in arrival order for listing, and each one's arrival number serves as a
+// pagination cursor that stays valid while other requests come and go.
+// A linear-probing table maps requesters to their place in the list, so
+// adding, finding and removing a request are O(1). Removed entries are
+// left as gaps and squeezed out once they outnumber the live ones.
+class PendingRequestSet {
+private:
+    struct Entry {
+        int requester;     // -1 once removed
+        uint64_t sequence; // Arrival number, starting at 1
+    };
+
+    struct Slot {
+        int requester; // -1 marks an empty slot
+        uint32_t entry;
+    };
+
+    vector<Entry> entries;
+    vector<Slot> slots;
+    size_t live;
+    uint64_t nextSequence;
+
+    size_t mask() const {
+        return slots.size() - 1;
+    }
+
+    size_t home(int requester) const {
+        return static_cast<size_t>((static_cast<uint64_t>(requester) * 0x9E3779B97F4A7C15ULL) >> 32) & mask();
+    }
+
+    // Slot holding requester, or the empty slot where it would go
+    size_t probe(int requester) const {
+        size_t pos = home(requester);
+        while (slots[pos].requester >= 0 && slots[pos].requester != requester) {
+            pos = (pos + 1) & mask();
+        }
+        return pos;
+    }
+
+    void rehash(size_t capacity) {
+        slots.assign(capacity, Slot{ -1, 0 });
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].requester >= 0) {
+                slots[probe(entries[i].requester)] = Slot{ entries[i].requester, static_cast<uint32_t>(i) };
+            }
+        }
+    }
+
+    void squeeze() {
+        size_t kept = 0;
+        for (const Entry& entry : entries) {
+            if (entry.requester >= 0) {
+                entries[kept++] = entry;
+            }
+        }
+        entries.resize(kept);
+        rehash(slots.size());
+    }
+
+public:
+    PendingRequestSet() : live(0), nextSequence(1) {}
+
+    size_t size() const {
+        return live;
+    }
+
+    bool isEmpty() const {
+        return live == 0;
+    }
+
+    bool contains(int requester) const {
+        return !slots.empty() && slots[probe(requester)].requester == requester;
+    }
+
+    // Returns false if requester already has a pending request
+    bool add(int requester) {
+        if (contains(requester)) {
+            return false;
+        }
+        if ((live + 1) * 2 > slots.size()) {
+            rehash(max<size_t>(16, slots.size() * 2));
+        }
+        slots[probe(requester)] = Slot{ requester, static_cast<uint32_t>(entries.size()) };
+        entries.push_back(Entry{ requester, nextSequence++ });
+        ++live;
+        return true;
+    }
+
+    // Returns false if requester had no pending request
+    bool remove(int requester) {
+        if (slots.empty()) {
+            return false;
+        }
+        size_t hole = probe(requester);
+        if (slots[hole].requester != requester) {
+            return false;
+        }
+        entries[slots[hole].entry].requester = -1;
+        --live;
+
+        // Backward-shift deletion: pull later entries of the probe run into
+        // the hole unless that would move them before their home slot
+        for (size_t next = (hole + 1) & mask(); slots[next].requester >= 0; next = (next + 1) & mask()) {
+            if (((next - home(slots[next].requester)) & mask()) >= ((next - hole) & mask())) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].requester = -1;
+
+        if (entries.size() - live > live) {
+            squeeze();
+        }
+        return true;
+    }
+
+    // Oldest first
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const Entry& entry : entries) {
+            if (entry.requester >= 0) {
+                fn(entry.requester);
+            }
+        }
+    }
+
+    // Appends up to limit requesters that arrived after cursor 'after' (0
+    // for the oldest), oldest first. Returns the cursor of the next page, or
+    // 0 when no requests follow.
+    uint64_t page(uint64_t after, size_t limit, vector<int>& requesters) const {
+        auto at = upper_bound(entries.begin(), entries.end(), after, [](uint64_t cursor, const Entry& entry) {
+            return cursor < entry.sequence;
+        });
+        uint64_t last = after;
+        for (size_t taken = 0; at != entries.end() && taken < limit; ++at) {
+            if (at->requester >= 0) {
+                requesters.push_back(at->requester);
+                last = at->sequence;
+                ++taken;
+            }
+        }
+        while (at != entries.end() && at->requester < 0) {
+            ++at;
+        }
+        return at == entries.end() ? 0 : last;
+    }
+
+    // Removes every request, returning the requesters oldest first
+    vector<int> takeAll() {
+        vector<int> requesters;
+        requesters.reserve(live);
+        forEach([&requesters](int requester) { requesters.push_back(requester); });
+        entries.clear();
+        slots.clear();
+        live = 0;
+        return requesters;
+    }
+};
+
+// GraphNode class declaration
+class GraphNode {
+public:
+    UserProfile* user;
+    int id;
+    SocialNetworkGraph* network;
+    PendingRequestSet pendingRequests; // Requester IDs
+    IdSet followees;                   // IDs of the users this one follows, mirroring user->following
+
+    GraphNode(UserProfile* userProfile);
+};
+
+// UserProfile class declaration
+class UserProfile {
+public:
+    static constexpr int FEED_PAGE_SIZE = 20;
+    static constexpr int REQUEST_PAGE_SIZE = 20;
+    static constexpr int MESSAGE_PAGE_SIZE = 20;
+
+    string name;
+    string password;
+    string securityQuestion;
+    string securityAnswer;
+    string city;
+    CustomTime lastLogin;
+
+    // Delivered notifications wait in the lock-free inbox until they are
+    // drained into the feed, where they coalesce: when the owner reads them,
+    // or by the sender that finds INBOX_LIMIT events waiting. Messages live
+    // in the graph's MessageStore.
+    static constexpr size_t INBOX_LIMIT = 64;
+    MpscInbox<Notification> incomingNotifications;
+    mutex feedLock; // Guards notifications; taken after any shard or conversation lock
+    NotificationFeed notifications;
+    CustomQueue<UserProfile*> followers;
+    CustomQueue<UserProfile*> following;
+    GraphNode* node;
+
+    UserProfile(string n, string p, string sq, string sa, string c);
+
+    // Safe to call from any thread; takes feedLock only to drain a full inbox
+    void notify(Notification::Type type, int actorId, CustomTime time, uint64_t objectId = 0);
+    // The caller must hold feedLock
+    void drainInbox();
+
+    void sendMessage(UserProfile* recipient, const string& content);
+    uint64_t createPost(const string& content);
+    // Returns false, doing nothing, if the request is already pending, the
+    // requester already follows the target, or both are the same user
+    bool sendFollowRequest(GraphNode* requesterNode, GraphNode* targetNode);
+    // Returns false if requestedNode has no pending request to graphNode
+    bool acceptFollowRequest(GraphNode* graphNode, GraphNode* requestedNode);
+    // Returns false if requestedNode has no pending request to graphNode
+    bool rejectFollowRequest(GraphNode* graphNode, GraphNode* requestedNode);
+    // Returns the number of requests accepted
+    int acceptAllFollowRequests(GraphNode* graphNode);
+    void displayFollowers();
+    void displayFollowing();
+    uint64_t displayTimeline(uint64_t before = 0);
+    void displayNewsfeed();
+    // Every notification, newest activity first, with whether it was unread;
+    // marks them all read
+    vector<pair<NotificationFeed::Entry, bool>> readNotifications();
+    string renderNotification(const NotificationFeed::Entry& entry) const;
+    void displayNotifications();
+    // Lists conversations, most recent first, with their unread counts
+    void displayInbox();
+    // Shows the page of the conversation with partner that comes before
+    // cursor 'before' (0 for the newest, which also marks it read); returns
+    // the cursor for the next older page, 0 when there are no more
+    uint64_t displayConversation(GraphNode* partner, uint64_t before = 0);
+    void displayConnections(GraphNode* graphNode);
+    // Shows the page of requests after cursor 'after' (0 for the oldest);
+    // returns the cursor for the next page, 0 when there are no more
+    uint64_t displayPendingRequests(GraphNode* graphNode, uint64_t after = 0);
+    string getProfileInfo() const {
+        return "Username: " + name + "\nCity: " + city + "\nLast Login: " + lastLogin.toString();
+    }
+};
+
+// GraphNode constructor definition
+GraphNode::GraphNode(UserProfile* userProfile) :
+    user(userProfile), id(-1), network(nullptr) {
+    userProfile->node = this;
+}
+
+// Social Network Graph Management
+// Thread-safe social graph. Users are spread over SHARD_COUNT shards by ID,
+// each guarded by a reader/writer lock that covers the users' adjacency
+// rows, profile queues, newsfeed state and suggestion cache entries.
+// Messages skip the locks and go to the MessageStore, which has its own;
+// notifications go through each recipient's lock-free inbox.
+// Usernames are indexed in separate shards chosen by name hash. Reads only
+// take shared locks, on the shards holding the rows they read; writes take
+// exclusive locks on the shards they change, always in ascending shard
+// order. The city index lock, when needed, is taken before any shard lock.
+class SocialNetworkGraph {
+public:
+    static constexpr int DEFAULT_SUGGESTIONS = 10;
+    // Extra mutual connections credited to same-city suggestions when asked
+    static constexpr int SAME_CITY_BONUS = 2;
+    static constexpr int SHARD_COUNT = ShardedAdjacency::SHARD_COUNT;
+
+    // Set of shard locks acquired in ascending order and released on destruction
+    class ShardGuard {
+    private:
+        const SocialNetworkGraph* graph;
+        uint32_t mask;
+        bool exclusive;
+
+    public:
+        ShardGuard(const SocialNetworkGraph* owner, uint32_t shardMask, bool exclusiveMode) :
+            graph(owner), mask(shardMask), exclusive(exclusiveMode) {
+            for (int shard = 0; shard < SHARD_COUNT; ++shard) {
+                if (mask & (1u << shard)) {
+                    if (exclusive) {
+                        graph->shards[shard].lock.lock();
+                    }
+                    else {
+                        graph->shards[shard].lock.lock_shared();
+                    }
+                }
+            }
+        }
+
+        ShardGuard(ShardGuard&& other) noexcept :
+            graph(other.graph), mask(other.mask), exclusive(other.exclusive) {
+            other.mask = 0;
+        }
+
+        ShardGuard(const ShardGuard&) = delete;
+        ShardGuard& operator=(const ShardGuard&) = delete;
+
+        ~ShardGuard() {
+            for (int shard = SHARD_COUNT - 1; shard >= 0; --shard) {
+                if (mask & (1u << shard)) {
+                    if (exclusive) {
+                        graph->shards[shard].lock.unlock();
+                    }
+                    else {
+                        graph->shards[shard].lock.unlock_shared();
+                    }
+                }
+            }
+        }
+    };
+
+private:
+    struct Shard {
+        shared_mutex lock;
+        mutex cacheLock; // Serializes suggestion cache fills under shared locks
+    };
+
+    struct NameShard {
+        shared_mutex lock;
+        UsernameIndex index;
+    };
+
+    static constexpr uint32_t ALL_SHARDS = (1u << SHARD_COUNT) - 1;
+
+    mutable Shard shards[SHARD_COUNT];
+    mutable NameShard nameShards[SHARD_COUNT];
+    mutex registrationLock;
+    mutex postOrderLock; // Held from post ID assignment to logging, so the log is in ID order
+    atomic<int> registeredUsers;
+    unique_ptr<MappedFile> snapshotFile; // Backs post text and adjacency rows loaded in place, until the next save
+    uint64_t snapshotSequence;           // Last log record included in the loaded snapshot
+    unique_ptr<WriteAheadLog> journal;
+    SegmentedVector<GraphNode*> nodes; // Indexed by dense user ID
+    ShardedAdjacency adjacency;
+    SuggestionCache suggestionCache;
+    PostStore postStore;
+    PostIndex postIndex;
+    NewsfeedService newsfeed;
+    MessageStore messageStore;
+    CityIndex cityIndex;
+    UserAuthenticator authenticator;
+
+    static uint32_t shardBit(int id) {
+        return 1u << ShardedAdjacency::shardOf(id);
+    }
+
+    // Writes the snapshot file; the caller holds registrationLock, every
+    // shard exclusively and messageStore.lockAll()
+    void writeSnapshot(const string& path, uint64_t logSequence);
+
+    // Copies the post text and adjacency rows still borrowed from the loaded
+    // snapshot into owned memory and unmaps it. A mapped file cannot be
+    // replaced on Windows. The caller holds every shard exclusively.
+    void releaseSnapshotFile();
+
+    // Re-runs one logged mutation during openLog
+    void applyLogRecord(WriteAheadLog::RecordReader& record);
+
+    static int nameShardOf(uint64_t hash) {
+        return static_cast<int>((hash >> 32) % SHARD_COUNT);
+    }
+
+    // Engine scratch space is per thread so concurrent readers don't share it
+    static TraversalEngine& traversalEngine() {
+        thread_local TraversalEngine engine;
+        return engine;
+    }
+
+    static MutualFriendEngine& mutualFriendEngine() {
+        thread_local MutualFriendEngine engine;
+        return engine;
+    }
+
+public:
+    SocialNetworkGraph() : registeredUsers(0), snapshotSequence(0), newsfeed(postStore) {}
+
+    ShardGuard readLock(const GraphNode* node) const {
+        return ShardGuard(this, shardBit(node->id), false);
+    }
+
+    ShardGuard readLock(const GraphNode* node1, const GraphNode* node2) const {
+        return ShardGuard(this, shardBit(node1->id) | shardBit(node2->id), false);
+    }
+
+    ShardGuard readAll() const {
+        return ShardGuard(this, ALL_SHARDS, false);
+    }
+
+    ShardGuard writeLock(const GraphNode* node) const {
+        return ShardGuard(this, shardBit(node->id), true);
+    }
+
+    ShardGuard writeLock(const GraphNode* node1, const GraphNode* node2) const {
+        return ShardGuard(this, shardBit(node1->id) | shardBit(node2->id), true);
+    }
+
+    ShardGuard writeAll() const {
+        return ShardGuard(this, ALL_SHARDS, true);
+    }
+
+    // Exclusive locks on every shard a new node1-node2 connection touches:
+    // both users and their friends, whose suggestion caches are updated
+    ShardGuard lockForConnection(const GraphNode* node1, const GraphNode* node2) const {
+        uint32_t mask = shardBit(node1->id) | shardBit(node2->id);
+        while (true) {
+            ShardGuard guard(this, mask, true);
+            uint32_t needed = mask;
+            auto addShard = [&](int friendId) { needed |= shardBit(friendId); };
+            adjacency.forEachNeighbor(node1->id, addShard);
+            adjacency.forEachNeighbor(node2->id, addShard);
+            if (needed == mask) {
+                return guard;
+            }
+            mask = needed;
+        }
+    }
+
+    // Shared locks on the shards in mask plus every shard needed(held)
+    // reports, where held is the set locked so far. Relocks with the larger
+    // set, in ascending order, until needed() asks for nothing new.
+    template <typename Needed>
+    ShardGuard readLockCovering(uint32_t mask, Needed&& needed) const {
+        while (true) {
+            ShardGuard guard(this, mask, false);
+            uint32_t wanted = mask | needed(mask);
+            if (wanted == mask) {
+                return guard;
+            }
+            mask = wanted;
+        }
+    }
+
+    // Shared locks on node's shard and its friends' shards: every row a
+    // 2-hop walk from node reads
+    ShardGuard readLockNeighborhood(const GraphNode* node) const {
+        return readLockCovering(shardBit(node->id), [&](uint32_t) {
+            uint32_t needed = 0;
+            adjacency.forEachNeighbor(node->id, [&](int friendId) { needed |= shardBit(friendId); });
+            return needed;
+        });
+    }
+
+    // Registers a new user; returns false if the username is already taken
+    bool addUser(GraphNode* newUserNode) {
+        if (!newUserNode) {
+            cout << "Error: Attempted to add a null user node." << endl;
+            return false;
+        }
+        const string& name = newUserNode->user->name;
+        uint64_t hash = UsernameIndex::hashName(name);
+        NameShard& nameShard = nameShards[nameShardOf(hash)];
+        unique_lock<shared_mutex> nameGuard(nameShard.lock);
+        if (nameShard.index.find(name, hash, [this](int candidate) -> const string& {
+            return nodes[candidate]->user->name;
+        }) >= 0) {
+            return false;
+        }
+
+        uint64_t sequence;
+        {
+            lock_guard<mutex> registration(registrationLock);
+            int id = registeredUsers.load(memory_order_relaxed);
+            nodes.ensure(id) = newUserNode;
+            newUserNode->id = id;
+            newUserNode->network = this;
+            suggestionCache.addUser(id);
+            postStore.addUser(id);
+            newsfeed.addUser(id);
+            messageStore.addUser(id);
+            cityIndex.addUser(id, newUserNode->user->city);
+            {
+                ShardGuard guard = writeLock(newUserNode);
+                adjacency.addVertex(id);
+            }
+            registeredUsers.store(id + 1, memory_order_release);
+            sequence = logMutation([newUserNode] {
+                const UserProfile* user = newUserNode->user;
+                return WriteAheadLog::RecordBuilder(WriteAheadLog::ADD_USER, CustomTime::getCurrentTime())
+                    .text(user->name).text(user->password).text(user->securityQuestion)
+                    .text(user->securityAnswer).text(user->city).data();
+            });
+        }
+        nameShard.index.insert(hash, newUserNode->id);
+        nameGuard.unlock();
+        awaitDurable(sequence);
+        return true;
+    }
+
+    GraphNode* findUser(const string& username) const {
+        uint64_t hash = UsernameIndex::hashName(username);
+        NameShard& nameShard = nameShards[nameShardOf(hash)];
+        shared_lock<shared_mutex> guard(nameShard.lock);
+        int id = nameShard.index.find(username, hash, [this](int candidate) -> const string& {
+            return nodes[candidate]->user->name;
+        });
+        return id >= 0 ? nodes[id] : nullptr;
+    }
+
+    GraphNode* getUser(int id) const {
+        return nodes[id];
+    }
+
+    int userCount() const {
+        return registeredUsers.load(memory_order_acquire);
+    }
+
+    bool verifyPassword(GraphNode* node, const string& password) const {
+        ShardGuard guard = readLock(node);
+        return node->user->password == password;
+    }
+
+    void resetPassword(GraphNode* node, const string& newPassword) {
+        uint64_t sequence;
+        {
+            ShardGuard guard = writeLock(node);
+            node->user->password = newPassword;
+            sequence = logMutation([&] {
+                return WriteAheadLog::RecordBuilder(WriteAheadLog::RESET_PASSWORD, CustomTime::getCurrentTime())
+                    .id(node->id).text(newPassword).data();
+            });
+        }
+        awaitDurable(sequence);
+    }
+
+    // Writes every user, connection, post, message and notification to path,
+    // replacing the file atomically. Blocks all other access while it runs.
+    void saveSnapshot(const string& path);
+
+    // Loads a snapshot into an empty graph before it is shared between
+    // threads. Post text and connections are used in place from the mapping
+    // until the next save copies them out;
+    // the post search index is rebuilt from the text.
+    void loadSnapshot(const string& path);
+
+    // Replays the write-ahead log at path on top of the loaded snapshot (if
+    // any) and then appends every later mutation to it. Call once, before
+    // the graph is shared between threads.
+    void openLog(const string& path);
+
+    // Builds an empty network from bulk dumps without logging: a users CSV
+    // (username,password,city,security question,security answer; only the
+    // username is required) and an edge list of "follower followee" lines
+    // that refer to users by their 0-based row in the users file. Follows
+    // are accepted as-is, with no requests or notifications. Returns the
+    // number of distinct follows. threadCount 0 uses every hardware thread.
+    long long importNetwork(const string& usersPath, const string& edgesPath, int threadCount = 0);
+
+    // Appends the record built by encode() to the log, if one is open, and
+    // returns its sequence number for awaitDurable (0 when not logging).
+    // Mutations log while holding their locks so the log order matches the
+    // order they were applied in.
+    template <typename Encode>
+    uint64_t logMutation(Encode&& encode) {
+        return journal ? journal->append(encode()) : 0;
+    }
+
+    // Waits for the group commit covering sequence; call after releasing
+    // locks. Throws StorageFailure if the log could not be written.
+    void awaitDurable(uint64_t sequence) {
+        if (sequence != 0) {
+            try {
+                journal->waitDurable(sequence);
+            }
+            catch (const exception& error) {
+                throw StorageFailure(error.what());
+            }
+        }
+    }
+
+    // Adds an undirected connection between two users unless they are
+    // already connected. The caller must hold lockForConnection(node1, node2).
+    void addConnection(GraphNode* node1, GraphNode* node2) {
+        if (adjacency.hasEdge(node1->id, node2->id)) {
+            return;
+        }
+        adjacency.addEdge(node1->id, node2->id);
+        adjacency.addEdge(node2->id, node1->id);
+        suggestionCache.onConnectionAdded(adjacency, mutualFriendEngine(), node1->id, node2->id);
+    }
+
+    // Connects node to each user in others at once. Suggestion caches the new
+    // edges affect are invalidated rather than updated edge by edge, which
+    // would cost a pass over node's friends per edge. The caller must hold
+    // writeAll().
+    void addConnections(GraphNode* node, const vector<int>& others) {
+        auto invalidate = [this](int user) { suggestionCache.invalidate(user); };
+        for (int other : others) {
+            if (adjacency.hasEdge(other, node->id)) {
+                continue;
+            }
+            adjacency.addEdge(node->id, other);
+            adjacency.addEdge(other, node->id);
+            invalidate(other);
+            adjacency.forEachNeighbor(other, invalidate);
+        }
+        invalidate(node->id);
+        adjacency.forEachNeighbor(node->id, invalidate);
+    }
+
+    // Whether follower already follows followee. The caller must hold a
+    // read lock on follower.
+    bool follows(const GraphNode* follower, const GraphNode* followee) const {
+        return follower->followees.contains(followee->id);
+    }
+
+    // Records that follower now sees followee's posts in their newsfeed.
+    // The caller must hold write locks on both users.
+    void addFollower(GraphNode* followee, GraphNode* follower) {
+        newsfeed.onFollow(follower->id, followee->id);
+    }
+
+    uint64_t publishPost(GraphNode* author, const string& content) {
+        uint64_t postId;
+        uint64_t sequence;
+        bool newCelebrity;
+        vector<int> recipients;
+        {
+            ShardGuard guard = writeLock(author);
+            CustomTime now = CustomTime::getCurrentTime();
+            {
+                // Replay hands out IDs in log order, so authors must not
+                // log in a different order than they took their IDs
+                unique_lock<mutex> ordered(postOrderLock, defer_lock);
+                if (journal) {
+                    ordered.lock();
+                }
+                postId = postStore.append(author->id, content, now);
+                sequence = logMutation([&] {
+                    return WriteAheadLog::RecordBuilder(WriteAheadLog::CREATE_POST, now).id(author->id).number(postId)
+                        .text(content).data();
+                });
+            }
+            recipients = newsfeed.beginPublish(author->id, postId, newCelebrity);
+        }
+
+        // Fan out one follower shard at a time
+        sort(recipients.begin(), recipients.end(), [](int a, int b) {
+            return ShardedAdjacency::shardOf(a) < ShardedAdjacency::shardOf(b);
+        });
+        for (size_t begin = 0; begin < recipients.size();) {
+            size_t end = begin;
+            ShardGuard guard(this, shardBit(recipients[begin]), true);
+            while (end < recipients.size() && shardBit(recipients[end]) == shardBit(recipients[begin])) {
+                newsfeed.deliver(recipients[end++], author->id, postId, newCelebrity);
+            }
+            begin = end;
+        }
+        postIndex.add(postId, content);
+        awaitDurable(sequence);
+        return postId;
+    }
+
+    // Locks the reader's shard and those of the celebrities whose posts are
+    // merged in, so only writers to those users are waited on
+    NewsfeedService::FeedPage readNewsfeed(GraphNode* reader, uint64_t before, int limit) const {
+        ShardGuard guard = readLockCovering(shardBit(reader->id), [&](uint32_t) {
+            uint32_t needed = 0;
+            for (int celebrity : newsfeed.followedCelebritiesOf(reader->id)) {
+                needed |= shardBit(celebrity);
+            }
+            return needed;
+        });
+        return newsfeed.read(reader->id, before, limit);
+    }
+
+    // Posts containing every word of query, newest first; see PostIndex
+    PostIndex::Page searchPosts(const string& query, uint64_t before, int limit) const {
+        return postIndex.search(query, before, limit);
+    }
+
+    // Returns fn(post), run under the author's shard read lock: text loaded
+    // from a snapshot moves out of the mapping when it is next saved
+    template <typename Fn>
+    auto withPost(uint64_t postId, Fn&& fn) const -> decltype(fn(declval<const Post&>())) {
+        const Post& post = postStore.get(postId);
+        ShardGuard guard(this, shardBit(post.authorId), false);
+        return fn(post);
+    }
+
+    string formatPost(uint64_t postId) const {
+        return withPost(postId, [this](const Post& post) {
+            return post.toString(nodes[post.authorId]->user->name);
+        });
+    }
+
+    // Visits the author's post IDs, newest first, outside the author's lock
+    template <typename Fn>
+    void forEachPostBy(GraphNode* author, Fn&& fn) const {
+        vector<uint64_t> posts;
+        {
+            ShardGuard guard = readLock(author);
+            posts = postStore.postsBy(author->id);
+        }
+        for (auto it = posts.rbegin(); it != posts.rend(); ++it) {
+            fn(*it);
+        }
+    }
+
+    // Appends to the sender-recipient conversation, then logs it and
+    // notifies the recipient under the conversation's lock; needs no shard
+    // lock. Returns the log sequence.
+    uint64_t deliverMessage(GraphNode* sender, GraphNode* recipient, const string& content, CustomTime timestamp) {
+        uint64_t sequence = 0;
+        messageStore.append(sender->id, recipient->id, content, timestamp, [&](uint64_t number) {
+            sequence = logMutation([&] {
+                return WriteAheadLog::RecordBuilder(WriteAheadLog::SEND_MESSAGE, timestamp)
+                    .id(sender->id).id(recipient->id).text(content).data();
+            });
+            recipient->user->notify(Notification::MESSAGE, sender->id, timestamp, number);
+        });
+        return sequence;
+    }
+
+    vector<MessageStore::Summary> readInbox(GraphNode* reader) const {
+        return messageStore.inbox(reader->id);
+    }
+
+    MessageStore::Page readConversation(GraphNode* reader, GraphNode* partner, uint64_t before, int limit) {
+        return messageStore.read(reader->id, partner->id, before, limit);
+    }
+
+    bool isConnected(GraphNode* node1, GraphNode* node2) const {
+        ShardGuard guard = readLock(node1);
+        return adjacency.hasEdge(node1->id, node2->id);
+    }
+
+    template <typename Fn>
+    void forEachConnection(GraphNode* node, Fn&& fn) const {
+        ShardGuard guard = readLock(node);
+        adjacency.forEachNeighbor(node->id, [&](int neighborId) {
+            fn(nodes[neighborId]);
+        });
+    }
+
+    // Top k suggestions for userNode, best first, with their mutual
+    // connection counts. With a cityBonus, candidates from the user's city
+    // rank as if they had that many more mutual connections; the cache only
+    // holds unboosted rankings, so boosted ones are computed each time.
+    vector<pair<GraphNode*, int>> topMutualFriends(GraphNode* userNode, int k, int cityBonus = 0) {
+        vector<pair<GraphNode*, int>> suggestions;
+        ShardGuard guard = readLockNeighborhood(userNode);
+        int city = cityIndex.cityOf(userNode->id);
+        if (cityBonus != 0 && city != CityIndex::NO_CITY) {
+            auto bonus = [&](int candidate) {
+                return cityIndex.cityOf(candidate) == city ? cityBonus : 0;
+            };
+            for (const MutualFriendEngine::Candidate& candidate : mutualFriendEngine().topK(adjacency, userNode->id, k, bonus)) {
+                suggestions.emplace_back(nodes[candidate.id], candidate.mutualCount);
+            }
+            return suggestions;
+        }
+        if (k <= SuggestionCache::CACHED_SUGGESTIONS) {
+            lock_guard<mutex> cacheGuard(shards[ShardedAdjacency::shardOf(userNode->id)].cacheLock);
+            const vector<MutualFriendEngine::Candidate>& cached = suggestionCache.get(adjacency, mutualFriendEngine(), userNode->id);
+            for (size_t i = 0; i < cached.size() && static_cast<int>(i) < k; ++i) {
+                suggestions.emplace_back(nodes[cached[i].id], cached[i].mutualCount);
+            }
+            return suggestions;
+        }
+        for (const MutualFriendEngine::Candidate& candidate : mutualFriendEngine().topK(adjacency, userNode->id, k)) {
+            suggestions.emplace_back(nodes[candidate.id], candidate.mutualCount);
+        }
+        return suggestions;
+    }
+
+    void suggestMutualFriends(GraphNode* userNode, int k = DEFAULT_SUGGESTIONS, int cityBonus = 0) {
+        cout << "Mutual Friends Suggestions for " << userNode->user->name << ":" << endl;
+
+        for (const pair<GraphNode*, int>& suggestion : topMutualFriends(userNode, k, cityBonus)) {
+            cout << suggestion.first->user->name << " (Mutual Connections: " << suggestion.second << ")" << endl;
+        }
+    }
+
+    int countMutualConnections(GraphNode* node1, GraphNode* node2) {
+        ShardGuard guard = readLock(node1, node2);
+        return mutualFriendEngine().countMutual(adjacency, node1->id, node2->id);
+    }
+
+    // Users living in city (matched ignoring case) who are friends of
+    // userNode or friends of friends, as (user, hops): friends first, then
+    // by ID. The city's member list is intersected with userNode's 2-hop
+    // frontier, so no other users are looked at.
+    vector<pair<GraphNode*, int>> nearbyInCity(GraphNode* userNode, const string& city) const {
+        vector<pair<GraphNode*, int>> nearby;
+        int user = userNode->id;
+        cityIndex.withMembers(city, [&](int number, const vector<int>& members) {
+            // The engine reads the members' rows only when there are no more
+            // members than the frontier costs; their shards are locked then
+            ShardGuard guard = readLockCovering(shardBit(user), [&](uint32_t held) {
+                uint32_t needed = 0;
+                adjacency.forEachNeighbor(user, [&](int friendId) { needed |= shardBit(friendId); });
+                if ((needed & ~held) != 0) {
+                    return needed;
+                }
+                size_t frontierCost = 0;
+                adjacency.forEachNeighbor(user, [&](int friendId) { frontierCost += adjacency.degree(friendId); });
+                if (members.size() <= frontierCost) {
+                    for (int member : members) {
+                        needed |= shardBit(member);
+                    }
+                }
+                return needed;
+            });
+            auto inCity = [&](int user) {
+                return cityIndex.cityOf(user) == number;
+            };
+            for (const pair<int, int>& found : mutualFriendEngine().withinTwoHops(adjacency, user, members, inCity)) {
+                nearby.emplace_back(nodes[found.first], found.second);
+            }
+        });
+        return nearby;
+    }
+
+    // Visits users reachable from startNode in BFS order. The whole walk
+    // holds shared locks, so visitors must not modify the graph.
+    template <typename Visitor>
+    void bfs(GraphNode* startNode, Visitor&& visit) const {
+        ShardGuard guard = readAll();
+        traversalEngine().breadthFirst(adjacency, startNode->id, [&](int id, int depth) {
+            return visit(nodes[id], depth);
+        });
+    }
+
+    // Visits users reachable from startNode in DFS pre-order
+    template <typename Visitor>
+    void dfs(GraphNode* startNode, Visitor&& visit) const {
+        ShardGuard guard = readAll();
+        traversalEngine().depthFirst(adjacency, startNode->id, [&](int id, int depth) {
+            return visit(nodes[id], depth);
+        });
+    }
+
+    // Hop distance from the nearest of the given users to every user, indexed
+    // by user ID (-1 if unreachable). threadCount 0 uses every hardware thread.
+    vector<int> hopDistances(const vector<GraphNode*>& sources, int threadCount = 0) const {
+        vector<int> sourceIds;
+        sourceIds.reserve(sources.size());
+        for (GraphNode* source : sources) {
+            sourceIds.push_back(source->id);
+        }
+        ShardGuard guard = readAll();
+        return ParallelBfs(adjacency, threadCount).run(sourceIds);
+    }
+
+    vector<int> hopDistances(GraphNode* source, int threadCount = 0) const {
+        return hopDistances(vector<GraphNode*>{ source }, threadCount);
+    }
+
+    // Breadth-First Search (BFS)
+    void bfsTraversal(GraphNode* startNode) {
+        if (!startNode) {
+            cout << "Error: Start node is null." << endl;
+            return;
+        }
+
+        cout << "BFS Traversal: ";
+        bfs(startNode, [](GraphNode* current, int) {
+            cout << current->user->name << " ";
+            return true;
+        });
+        cout << endl;
+    }
+
+    // Depth-First Search (DFS)
+    void dfsTraversal(GraphNode* startNode) {
+        if (!startNode) {
+            cout << "Error: Start node is null." << endl;
+            return;
+        }
 
-        return mutualCount;
+        cout << "DFS Traversal: ";
+        dfs(startNode, [](GraphNode* current, int) {
+            cout << current->user->name << " ";
+            return true;
+        });
+        cout << endl;
     }
 };
 
@@ -467,70 +4638,137 @@ private:
 UserProfile::UserProfile(string n, string p, string sq, string sa, string c) :
     name(n), password(p),
     securityQuestion(sq),
-    securityAnswer(sa), city(c) {}
-
-void UserProfile::sendMessage(UserProfile* recipient, const string& content) {
-    Message msg{ name, content, false, CustomTime::getCurrentTime() };
-    recipient->messages.push(msg);
-    recipient->notifications.enqueue(
-        Notification{ "New message from " + name, false, CustomTime::getCurrentTime() }
-    );
+    securityAnswer(sa), city(c), node(nullptr) {}
+
+void UserProfile::notify(Notification::Type type, int actorId, CustomTime time, uint64_t objectId) {
+    if (incomingNotifications.push(Notification{ type, actorId, objectId, time }) >= INBOX_LIMIT) {
+        // Nobody is reading; fold the backlog into the feed so a flood of
+        // unread events stays bounded
+        lock_guard<mutex> guard(feedLock);
+        drainInbox();
+    }
 }
 
-void UserProfile::createPost(const string& content) {
-    Post newPost{ content, name, CustomTime::getCurrentTime() };
-    posts.push(newPost);
+void UserProfile::drainInbox() {
+    incomingNotifications.drain([this](Notification&& notification) {
+        notifications.add(notification);
+    });
 }
 
-void UserProfile::sendFollowRequest(GraphNode* requesterNode, GraphNode* targetNode) {
-    targetNode->pendingRequests.enqueue(requesterNode);
-    string notification = "Follow request from " + requesterNode->user->name;
-    targetNode->user->notifications.enqueue(
-        Notification{ notification, false, CustomTime::getCurrentTime() }
-    );
+void UserProfile::sendMessage(UserProfile* recipient, const string& content) {
+    SocialNetworkGraph* network = recipient->node->network;
+    CustomTime now = CustomTime::getCurrentTime();
+    uint64_t sequence = network->deliverMessage(node, recipient->node, content, now);
+    network->awaitDurable(sequence);
 }
 
-void UserProfile::acceptFollowRequest(GraphNode* graphNode, int requestIndex) {
-    CustomQueue<GraphNode*> tempQueue;
-    GraphNode* requestedNode = nullptr;
-    int currentIndex = 1;
+uint64_t UserProfile::createPost(const string& content) {
+    return node->network->publishPost(node, content);
+}
 
-    // Find the specific request
-    while (!graphNode->pendingRequests.isEmpty()) {
-        GraphNode* currentRequest = graphNode->pendingRequests.dequeue();
-        if (currentIndex == requestIndex) {
-            requestedNode = currentRequest;
-        }
-        else {
-            tempQueue.enqueue(currentRequest);
+bool UserProfile::sendFollowRequest(GraphNode* requesterNode, GraphNode* targetNode) {
+    SocialNetworkGraph* network = targetNode->network;
+    uint64_t sequence;
+    {
+        SocialNetworkGraph::ShardGuard guard = network->writeLock(requesterNode, targetNode);
+        if (requesterNode == targetNode || network->follows(requesterNode, targetNode) ||
+            !targetNode->pendingRequests.add(requesterNode->id)) {
+            return false;
         }
-        currentIndex++;
+        CustomTime now = CustomTime::getCurrentTime();
+        targetNode->user->notify(Notification::FOLLOW_REQUEST, requesterNode->id, now);
+        sequence = network->logMutation([&] {
+            return WriteAheadLog::RecordBuilder(WriteAheadLog::FOLLOW_REQUEST, now)
+                .id(requesterNode->id).id(targetNode->id).data();
+        });
     }
+    network->awaitDurable(sequence);
+    return true;
+}
 
-    // Restore pending requests queue
-    while (!tempQueue.isEmpty()) {
-        graphNode->pendingRequests.enqueue(tempQueue.dequeue());
+bool UserProfile::acceptFollowRequest(GraphNode* graphNode, GraphNode* requestedNode) {
+    SocialNetworkGraph* network = graphNode->network;
+    bool stillPending;
+    uint64_t sequence = 0;
+    {
+        // A concurrent accept or reject may already have taken the request
+        SocialNetworkGraph::ShardGuard guard = network->lockForConnection(graphNode, requestedNode);
+        stillPending = graphNode->pendingRequests.remove(requestedNode->id);
+
+        // If a valid request was found
+        if (stillPending) {
+            // Add connection in both directions
+            graphNode->network->addConnection(graphNode, requestedNode);
+
+            // Add to followers/following lists
+            followers.enqueue(requestedNode->user);
+            requestedNode->user->following.enqueue(graphNode->user);
+            requestedNode->followees.add(graphNode->id);
+            graphNode->network->addFollower(graphNode, requestedNode);
+
+            // Create notifications
+            CustomTime now = CustomTime::getCurrentTime();
+            requestedNode->user->notify(Notification::REQUEST_ACCEPTED, graphNode->id, now);
+
+            sequence = network->logMutation([&] {
+                return WriteAheadLog::RecordBuilder(WriteAheadLog::ACCEPT_REQUEST, now)
+                    .id(graphNode->id).id(requestedNode->id).data();
+            });
+        }
     }
+    network->awaitDurable(sequence);
+    return stillPending;
+}
 
-    // If a valid request was found
-    if (requestedNode) {
-        // Add connection in both directions
-        graphNode->connections.enqueue(requestedNode);
-        requestedNode->connections.enqueue(graphNode);
-
-        // Add to followers/following lists
-        followers.enqueue(requestedNode->user);
-        requestedNode->user->following.enqueue(graphNode->user);
+bool UserProfile::rejectFollowRequest(GraphNode* graphNode, GraphNode* requestedNode) {
+    SocialNetworkGraph* network = graphNode->network;
+    uint64_t sequence = 0;
+    {
+        SocialNetworkGraph::ShardGuard guard = network->writeLock(graphNode);
+        if (!graphNode->pendingRequests.remove(requestedNode->id)) {
+            return false;
+        }
+        sequence = network->logMutation([&] {
+            return WriteAheadLog::RecordBuilder(WriteAheadLog::REJECT_REQUEST, CustomTime::getCurrentTime())
+                .id(graphNode->id).id(requestedNode->id).data();
+        });
+    }
+    network->awaitDurable(sequence);
+    return true;
+}
 
-        // Create notifications
-        string notification = "Follow request accepted by " + graphNode->user->name;
-        requestedNode->user->notifications.enqueue(
-            Notification{ notification, false, CustomTime::getCurrentTime() }
-        );
+int UserProfile::acceptAllFollowRequests(GraphNode* graphNode) {
+    SocialNetworkGraph* network = graphNode->network;
+    vector<int> requesters;
+    uint64_t sequence;
+    {
+        // One pass under every shard lock instead of one lock round per request
+        SocialNetworkGraph::ShardGuard guard = network->writeAll();
+        requesters = graphNode->pendingRequests.takeAll();
+        if (requesters.empty()) {
+            return 0;
+        }
+        network->addConnections(graphNode, requesters);
+        CustomTime now = CustomTime::getCurrentTime();
+        for (int id : requesters) {
+            GraphNode* requestedNode = network->getUser(id);
+            followers.enqueue(requestedNode->user);
+            requestedNode->user->following.enqueue(this);
+            requestedNode->followees.add(graphNode->id);
+            network->addFollower(graphNode, requestedNode);
+            requestedNode->user->notify(Notification::REQUEST_ACCEPTED, graphNode->id, now);
+        }
+        sequence = network->logMutation([&] {
+            return WriteAheadLog::RecordBuilder(WriteAheadLog::ACCEPT_ALL_REQUESTS, now)
+                .id(graphNode->id).data();
+        });
     }
+    network->awaitDurable(sequence);
+    return static_cast<int>(requesters.size());
 }
 
 void UserProfile::displayFollowers() {
+    SocialNetworkGraph::ShardGuard guard = node->network->readLock(node);
     cout << "--- Followers ---" << endl;
     if (followers.isEmpty()) {
         cout << "No followers yet." << endl;
@@ -538,14 +4776,13 @@ void UserProfile::displayFollowers() {
     }
 
     int index = 1;
-    CustomQueue<UserProfile*> tempFollowers = followers;
-    while (!tempFollowers.isEmpty()) {
-        UserProfile* current = tempFollowers.dequeue();
+    for (UserProfile* current : followers) {
         cout << index++ << ". " << current->name << endl;
     }
 }
 
 void UserProfile::displayFollowing() {
+    SocialNetworkGraph::ShardGuard guard = node->network->readLock(node);
     cout << "--- Following ---" << endl;
     if (following.isEmpty()) {
         cout << "Not following anyone yet." << endl;
@@ -553,100 +4790,810 @@ void UserProfile::displayFollowing() {
     }
 
     int index = 1;
-    CustomQueue<UserProfile*> tempFollowing = following;
-    while (!tempFollowing.isEmpty()) {
-        UserProfile* current = tempFollowing.dequeue();
+    for (UserProfile* current : following) {
         cout << index++ << ". " << current->name << endl;
     }
 }
 
-void UserProfile::displayTimeline() {
+// Shows one page of followed users' posts, newest first, and returns the
+// cursor for the next page (0 when there are no more posts)
+uint64_t UserProfile::displayTimeline(uint64_t before) {
     cout << "--- Timeline ---" << endl;
-    if (following.isEmpty()) {
+    bool followsNobody;
+    {
+        SocialNetworkGraph::ShardGuard guard = node->network->readLock(node);
+        followsNobody = following.isEmpty();
+    }
+    if (followsNobody) {
         cout << "Follow some users to see their posts!" << endl;
-        return;
+        return 0;
     }
 
-    CustomQueue<UserProfile*> tempFollowing = following;
-    while (!tempFollowing.isEmpty()) {
-        UserProfile* current = tempFollowing.dequeue();
-        cout << "Posts by " << current->name << ":" << endl;
-
-        CustomStack<Post> tempPosts = current->posts;
-        if (tempPosts.isEmpty()) {
-            cout << "No posts yet." << endl;
-        }
-        else {
-            while (!tempPosts.isEmpty()) {
-                Post post = tempPosts.pop();
-                cout << post.toString() << endl;
-            }
-        }
+    NewsfeedService::FeedPage page = node->network->readNewsfeed(node, before, FEED_PAGE_SIZE);
+    if (page.postIds.empty()) {
+        cout << "No posts yet." << endl;
+    }
+    for (uint64_t postId : page.postIds) {
+        cout << node->network->formatPost(postId) << endl;
     }
+    return page.nextCursor;
 }
 
 void UserProfile::displayNewsfeed() {
     cout << "--- Your Posts ---" << endl;
-    if (posts.isEmpty()) {
+    bool hasPosts = false;
+    node->network->forEachPostBy(node, [&](uint64_t postId) {
+        cout << node->network->formatPost(postId) << endl;
+        hasPosts = true;
+    });
+    if (!hasPosts) {
         cout << "No posts yet." << endl;
-        return;
     }
+}
 
-    CustomStack<Post> tempPosts = posts;
-    while (!tempPosts.isEmpty()) {
-        Post post = tempPosts.pop();
-        cout << post.toString() << endl;
-    }
+vector<pair<NotificationFeed::Entry, bool>> UserProfile::readNotifications() {
+    lock_guard<mutex> guard(feedLock);
+    drainInbox();
+    // Merged entries move up with their latest event; entries stamped
+    // within the same clock tick stay newest first
+    vector<pair<NotificationFeed::Entry, bool>> entries;
+    notifications.forEach([&entries](const NotificationFeed::Entry& entry, bool unread, const unordered_set<int>*) {
+        entries.emplace_back(entry, unread);
+    });
+    reverse(entries.begin(), entries.end());
+    stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return b.first.timestamp < a.first.timestamp;
+    });
+    notifications.markAllRead();
+    return entries;
+}
+
+string UserProfile::renderNotification(const NotificationFeed::Entry& entry) const {
+    SocialNetworkGraph* network = node->network;
+    return NotificationFeed::render(entry, [network](int id) {
+        return network->getUser(id)->user->name;
+    });
 }
 
 void UserProfile::displayNotifications() {
+    vector<pair<NotificationFeed::Entry, bool>> entries = readNotifications();
     cout << "--- Notifications ---" << endl;
-    if (notifications.isEmpty()) {
+    if (entries.empty()) {
         cout << "No notifications." << endl;
         return;
     }
 
-    CustomQueue<Notification> tempNotifications = notifications;
     int index = 1;
-    while (!tempNotifications.isEmpty()) {
-        Notification notification = tempNotifications.dequeue();
-        cout << index++ << ". " << notification.toString() << endl;
+    for (const auto& entry : entries) {
+        cout << index++ << ". " << renderNotification(entry.first) << (entry.second ? " (Unread)" : "")
+            << " - " << entry.first.timestamp.toString() << endl;
     }
 }
 
-void UserProfile::displayMessages() {
-    cout << "--- Messages ---" << endl;
-    if (messages.isEmpty()) {
+void UserProfile::displayInbox() {
+    SocialNetworkGraph* network = node->network;
+    vector<MessageStore::Summary> conversations = network->readInbox(node);
+    cout << "--- Inbox ---" << endl;
+    if (conversations.empty()) {
         cout << "No messages." << endl;
         return;
     }
 
-    CustomStack<Message> tempMessages = messages;
     int index = 1;
-    while (!tempMessages.isEmpty()) {
-        Message message = tempMessages.pop();
-        cout << index++ << ". " << message.toString() << endl;
+    for (const MessageStore::Summary& conversation : conversations) {
+        cout << index++ << ". " << network->getUser(conversation.partnerId)->user->name;
+        if (conversation.unread > 0) {
+            cout << " (" << conversation.unread << " unread)";
+        }
+        cout << " - " << conversation.last.toString(network->getUser(conversation.last.senderId)->user->name, false) << endl;
+    }
+}
+
+uint64_t UserProfile::displayConversation(GraphNode* partner, uint64_t before) {
+    SocialNetworkGraph* network = node->network;
+    MessageStore::Page page = network->readConversation(node, partner, before, MESSAGE_PAGE_SIZE);
+    if (before == 0) {
+        cout << "--- Conversation with " << partner->user->name << " ---" << endl;
+        if (page.messages.empty()) {
+            cout << "No messages." << endl;
+        }
     }
+    for (const MessageStore::PageEntry& entry : page.messages) {
+        cout << entry.number << ". " << entry.message.toString(network->getUser(entry.message.senderId)->user->name,
+            entry.unread) << endl;
+    }
+    return page.nextCursor;
 }
 
 void UserProfile::displayConnections(GraphNode* graphNode) {
     cout << "Connections for " << graphNode->user->name << ":" << endl;
-    CustomQueue<GraphNode*> tempConnections = graphNode->connections;
     int index = 1;
-    while (!tempConnections.isEmpty()) {
-        GraphNode* current = tempConnections.dequeue();
+    graphNode->network->forEachConnection(graphNode, [&](GraphNode* current) {
         cout << index++ << ". " << current->user->name << endl;
+    });
+}
+
+uint64_t UserProfile::displayPendingRequests(GraphNode* graphNode, uint64_t after) {
+    SocialNetworkGraph* network = graphNode->network;
+    SocialNetworkGraph::ShardGuard guard = network->readLock(graphNode);
+    if (after == 0) {
+        cout << "Pending Follow Requests for " << graphNode->user->name << " ("
+            << graphNode->pendingRequests.size() << "):" << endl;
+    }
+    vector<int> requesters;
+    uint64_t next = graphNode->pendingRequests.page(after, REQUEST_PAGE_SIZE, requesters);
+    for (int id : requesters) {
+        cout << "- " << network->getUser(id)->user->name << endl;
     }
+    return next;
 }
 
-void UserProfile::displayPendingRequests(GraphNode* graphNode) {
-    cout << "Pending Follow Requests for " << graphNode->user->name << ":" << endl;
-    CustomQueue<GraphNode*> tempPendingRequests = graphNode->pendingRequests;
-    int index = 1;
-    while (!tempPendingRequests.isEmpty()) {
-        GraphNode* current = tempPendingRequests.dequeue();
-        cout << index++ << ". " << current->user->name << endl;
+// Snapshot persistence
+void SocialNetworkGraph::saveSnapshot(const string& path) {
+    // Every mutation applies and logs under one of these locks, so none is
+    // caught half done. They are all taken before the log lock, as the
+    // mutations take them.
+    lock_guard<mutex> registration(registrationLock);
+    ShardGuard guard(this, ALL_SHARDS, true);
+    vector<unique_lock<mutex>> messageGuards = messageStore.lockAll();
+    if (journal) {
+        // The snapshot replaces the log; appends wait until it is written
+        journal->checkpoint([&](uint64_t logSequence) {
+            writeSnapshot(path, logSequence);
+        });
+    }
+    else {
+        writeSnapshot(path, snapshotSequence);
+    }
+}
+
+void SocialNetworkGraph::writeSnapshot(const string& path, uint64_t logSequence) {
+    typedef SnapshotFormat Format;
+    int count = userCount();
+    // Readers of a feed take only its lock
+    vector<unique_lock<mutex>> feedGuards;
+    feedGuards.reserve(count);
+    for (int id = 0; id < count; ++id) {
+        feedGuards.emplace_back(nodes[id]->user->feedLock);
+        nodes[id]->user->drainInbox();
+    }
+    for (int shard = 0; shard < SHARD_COUNT; ++shard) {
+        adjacency.shard(shard).compact();
+    }
+
+    vector<const MessageStore::Conversation*> conversations = messageStore.conversations();
+    auto forEachMessage = [](const MessageStore::Conversation* conversation, auto&& fn) {
+        for (uint64_t number = conversation->firstNumber; number <= conversation->lastNumber; ++number) {
+            fn(conversation->at(number));
+        }
+    };
+
+    string temporaryPath = path + ".tmp";
+    SnapshotWriter writer(temporaryPath);
+
+    // The blob is written in exactly the order the records below claim
+    // their strings, so each record's offset is a running total
+    writer.beginSection(Format::STRINGS);
+    auto writeText = [&writer](string_view text) {
+        writer.write(text.data(), text.size());
+    };
+    for (int id = 0; id < count; ++id) {
+        const UserProfile* user = nodes[id]->user;
+        writeText(user->name);
+        writeText(user->password);
+        writeText(user->securityQuestion);
+        writeText(user->securityAnswer);
+        writeText(user->city);
+    }
+    for (uint64_t postId = 1; postId <= postStore.size(); ++postId) {
+        writeText(postStore.get(postId).content);
+    }
+    for (const MessageStore::Conversation* conversation : conversations) {
+        forEachMessage(conversation, [&](const Message& message) {
+            writeText(message.content);
+        });
+    }
+    writer.endSection();
+
+    uint64_t nextString = 0;
+    auto claim = [&nextString](string_view text) {
+        Format::StringRef ref{ nextString, text.size() };
+        nextString += text.size();
+        return ref;
+    };
+
+    writer.beginSection(Format::USERS);
+    for (int id = 0; id < count; ++id) {
+        const UserProfile* user = nodes[id]->user;
+        Format::UserRecord record{};
+        record.name = claim(user->name);
+        record.password = claim(user->password);
+        record.securityQuestion = claim(user->securityQuestion);
+        record.securityAnswer = claim(user->securityAnswer);
+        record.city = claim(user->city);
+        record.lastLogin = Format::toRecord(user->lastLogin);
+        record.celebritySince = newsfeed.celebritySinceOf(id);
+        record.unreadNotifications = static_cast<uint32_t>(user->notifications.unreadCount());
+        writer.write(&record, sizeof(record));
+    }
+    writer.endSection();
+
+    writer.beginSection(Format::POSTS);
+    for (uint64_t postId = 1; postId <= postStore.size(); ++postId) {
+        const Post& post = postStore.get(postId);
+        Format::PostRecord record{};
+        record.id = post.id;
+        record.authorId = post.authorId;
+        record.content = claim(post.content);
+        record.timestamp = Format::toRecord(post.timestamp);
+        writer.write(&record, sizeof(record));
+    }
+    writer.endSection();
+
+    writer.beginSection(Format::CONVERSATIONS);
+    for (const MessageStore::Conversation* conversation : conversations) {
+        Format::ConversationRecord record{};
+        record.users[0] = conversation->users[0];
+        record.users[1] = conversation->users[1];
+        record.firstNumber = conversation->firstNumber;
+        record.readThrough[0] = conversation->readThrough[0];
+        record.readThrough[1] = conversation->readThrough[1];
+        writer.write(&record, sizeof(record));
+    }
+    writer.endSection();
+    writer.writeLists<Format::MessageRecord>(Format::MESSAGES_INDEX, Format::MESSAGES, conversations.size(), [&](size_t i, auto&& emit) {
+        forEachMessage(conversations[i], [&](const Message& message) {
+            Format::MessageRecord record{};
+            record.senderId = message.senderId;
+            record.content = claim(message.content);
+            record.timestamp = Format::toRecord(message.timestamp);
+            emit(record);
+        });
+    });
+    writer.writeLists<Format::NotificationRecord>(Format::NOTIFICATIONS_INDEX, Format::NOTIFICATIONS, count, [&](size_t id, auto&& emit) {
+        nodes[id]->user->notifications.forEach([&](const NotificationFeed::Entry& entry, bool,
+            const unordered_set<int>* openActors) {
+            Format::NotificationRecord record{};
+            record.type = entry.type;
+            record.open = openActors != nullptr;
+            record.actorId = entry.actorId;
+            record.objectId = entry.objectId;
+            record.eventCount = entry.eventCount;
+            record.actorCount = entry.actorCount;
+            record.timestamp = Format::toRecord(entry.timestamp);
+            emit(record);
+        });
+    });
+    writer.writeLists<int32_t>(Format::NOTIFICATION_ACTORS_INDEX, Format::NOTIFICATION_ACTORS, count, [&](size_t id, auto&& emit) {
+        nodes[id]->user->notifications.forEach([&](const NotificationFeed::Entry&, bool,
+            const unordered_set<int>* openActors) {
+            if (openActors) {
+                for (int actor : *openActors) {
+                    emit(actor);
+                }
+            }
+        });
+    });
+
+    for (int shard = 0; shard < SHARD_COUNT; ++shard) {
+        const CompactAdjacency& rows = adjacency.shard(shard);
+        const vector<int>& offsets = rows.compressedOffsets();
+        writer.writeSection(Format::ADJACENCY_OFFSETS, shard, offsets.data(), offsets.size() * sizeof(int));
+        writer.writeSection(Format::ADJACENCY_NEIGHBORS, shard, rows.compressedNeighbors(), offsets.back() * sizeof(int));
+    }
+
+    writer.writeLists<int32_t>(Format::FOLLOWERS_INDEX, Format::FOLLOWERS, count, [&](size_t id, auto&& emit) {
+        for (const UserProfile* follower : nodes[id]->user->followers) {
+            emit(follower->node->id);
+        }
+    });
+    writer.writeLists<int32_t>(Format::FOLLOWING_INDEX, Format::FOLLOWING, count, [&](size_t id, auto&& emit) {
+        for (const UserProfile* followee : nodes[id]->user->following) {
+            emit(followee->node->id);
+        }
+    });
+    writer.writeLists<int32_t>(Format::PENDING_INDEX, Format::PENDING, count, [&](size_t id, auto&& emit) {
+        nodes[id]->pendingRequests.forEach(emit);
+    });
+    writer.writeLists<int32_t>(Format::CELEBRITIES_INDEX, Format::CELEBRITIES, count, [&](size_t id, auto&& emit) {
+        for (int celebrity : newsfeed.followedCelebritiesOf(static_cast<int>(id))) {
+            emit(celebrity);
+        }
+    });
+    writer.writeLists<uint64_t>(Format::INBOX_INDEX, Format::INBOX, count, [&](size_t id, auto&& emit) {
+        for (uint64_t postId : newsfeed.inboxOf(static_cast<int>(id))) {
+            emit(postId);
+        }
+    });
+    Format::MetaRecord meta{ logSequence };
+    writer.writeSection(Format::META, 0, &meta, sizeof(meta));
+    writer.finish();
+    DurableIo::syncPath(temporaryPath);
+    releaseSnapshotFile();
+    // Durable before the checkpoint truncates the log it replaces
+    DurableIo::replaceFile(temporaryPath, path);
+    snapshotSequence = logSequence;
+}
+
+void SocialNetworkGraph::releaseSnapshotFile() {
+    if (!snapshotFile) {
+        return;
+    }
+    for (int shard = 0; shard < SHARD_COUNT; ++shard) {
+        adjacency.shard(shard).ownNeighbors();
+    }
+    postStore.ownContent(snapshotFile->data(), snapshotFile->data() + snapshotFile->size());
+    snapshotFile.reset();
+}
+
+void SocialNetworkGraph::loadSnapshot(const string& path) {
+    typedef SnapshotFormat Format;
+    if (userCount() != 0) {
+        throw runtime_error("Snapshots can only be loaded into an empty network");
+    }
+    // Kept alive from here on: restored posts and rows point into it
+    snapshotFile.reset(new MappedFile(path));
+    SnapshotReader reader(*snapshotFile);
+
+    size_t count;
+    const Format::MetaRecord* meta = reader.array<Format::MetaRecord>(Format::META, 0, count);
+    if (count != 1) {
+        throw runtime_error("Corrupt snapshot: bad meta section");
+    }
+    snapshotSequence = meta->logSequence;
+
+    const Format::UserRecord* users = reader.array<Format::UserRecord>(Format::USERS, 0, count);
+    for (size_t id = 0; id < count; ++id) {
+        const Format::UserRecord& record = users[id];
+        UserProfile* user = new UserProfile(string(reader.text(record.name)), string(reader.text(record.password)),
+            string(reader.text(record.securityQuestion)), string(reader.text(record.securityAnswer)),
+            string(reader.text(record.city)));
+        user->lastLogin = Format::fromRecord(record.lastLogin);
+        if (!addUser(new GraphNode(user))) {
+            throw runtime_error("Corrupt snapshot: duplicate username " + user->name);
+        }
+    }
+    auto checkUser = [count](int32_t id) {
+        if (id < 0 || static_cast<size_t>(id) >= count) {
+            throw runtime_error("Corrupt snapshot: user ID out of range");
+        }
+        return id;
+    };
+
+    for (int shard = 0; shard < SHARD_COUNT; ++shard) {
+        size_t offsetCount, neighborCount;
+        const int* offsets = reader.array<int>(Format::ADJACENCY_OFFSETS, shard, offsetCount);
+        const int* neighbors = reader.array<int>(Format::ADJACENCY_NEIGHBORS, shard, neighborCount);
+        for (size_t i = 0; i < offsetCount; ++i) {
+            if (offsets[i] < (i == 0 ? 0 : offsets[i - 1]) || static_cast<size_t>(offsets[i]) > neighborCount) {
+                throw runtime_error("Corrupt snapshot: bad adjacency offsets");
+            }
+        }
+        for (size_t i = 0; i < neighborCount; ++i) {
+            checkUser(neighbors[i]);
+        }
+        adjacency.shard(shard).adopt(vector<int>(offsets, offsets + offsetCount), neighbors, neighborCount);
+    }
+
+    size_t postCount;
+    const Format::PostRecord* posts = reader.array<Format::PostRecord>(Format::POSTS, 0, postCount);
+    for (size_t i = 0; i < postCount; ++i) {
+        const Format::PostRecord& record = posts[i];
+        if (record.id != i + 1) {
+            throw runtime_error("Corrupt snapshot: post IDs are not dense");
+        }
+        postStore.restore(Post{ record.id, checkUser(record.authorId), reader.text(record.content),
+            Format::fromRecord(record.timestamp) });
+        postIndex.add(record.id, reader.text(record.content));
+    }
+
+    SnapshotReader::Lists<int32_t> followers(reader, Format::FOLLOWERS_INDEX, Format::FOLLOWERS, count);
+    SnapshotReader::Lists<int32_t> following(reader, Format::FOLLOWING_INDEX, Format::FOLLOWING, count);
+    SnapshotReader::Lists<int32_t> pending(reader, Format::PENDING_INDEX, Format::PENDING, count);
+    SnapshotReader::Lists<int32_t> celebrities(reader, Format::CELEBRITIES_INDEX, Format::CELEBRITIES, count);
+    SnapshotReader::Lists<uint64_t> inboxes(reader, Format::INBOX_INDEX, Format::INBOX, count);
+    SnapshotReader::Lists<Format::NotificationRecord> notifications(reader, Format::NOTIFICATIONS_INDEX,
+        Format::NOTIFICATIONS, count);
+    SnapshotReader::Lists<int32_t> notificationActors(reader, Format::NOTIFICATION_ACTORS_INDEX,
+        Format::NOTIFICATION_ACTORS, count);
+
+    for (size_t id = 0; id < count; ++id) {
+        GraphNode* node = nodes[id];
+        UserProfile* user = node->user;
+        size_t items;
+
+        const int32_t* list = followers.items(id, items);
+        vector<int> feedFollowers(list, list + items);
+        for (int follower : feedFollowers) {
+            user->followers.enqueue(nodes[checkUser(follower)]->user);
+        }
+        list = following.items(id, items);
+        node->followees.reserve(items);
+        for (size_t i = 0; i < items; ++i) {
+            user->following.enqueue(nodes[checkUser(list[i])]->user);
+            node->followees.add(list[i]);
+        }
+        list = pending.items(id, items);
+        for (size_t i = 0; i < items; ++i) {
+            node->pendingRequests.add(checkUser(list[i]));
+        }
+
+        list = celebrities.items(id, items);
+        vector<int> followedCelebrities;
+        for (size_t i = 0; i < items; ++i) {
+            followedCelebrities.push_back(checkUser(list[i]));
+        }
+        const uint64_t* inbox = inboxes.items(id, items);
+        for (size_t i = 0; i < items; ++i) {
+            if (inbox[i] == 0 || inbox[i] > postCount) {
+                throw runtime_error("Corrupt snapshot: inbox post out of range");
+            }
+        }
+        newsfeed.restore(static_cast<int>(id), std::move(feedFollowers), std::move(followedCelebrities),
+            users[id].celebritySince, inbox, items);
+
+        const Format::NotificationRecord* notification = notifications.items(id, items);
+        size_t actorCount;
+        const int32_t* actors = notificationActors.items(id, actorCount);
+        const int32_t* actorsEnd = actors + actorCount;
+        size_t firstUnread = items - min<size_t>(items, users[id].unreadNotifications);
+        for (size_t i = 0; i < items; ++i) {
+            const Format::NotificationRecord& record = notification[i];
+            if (record.type < 1 || record.type > Notification::TYPE_COUNT || record.eventCount == 0 ||
+                record.actorCount == 0 || (record.open && record.actorCount > static_cast<size_t>(actorsEnd - actors))) {
+                throw runtime_error("Corrupt snapshot: bad notification");
+            }
+            const int32_t* openActors = nullptr;
+            if (record.open) {
+                openActors = actors;
+                actors += record.actorCount;
+                for (const int32_t* actor = openActors; actor < actors; ++actor) {
+                    checkUser(*actor);
+                }
+            }
+            user->notifications.restore(NotificationFeed::Entry{ static_cast<Notification::Type>(record.type),
+                checkUser(record.actorId), record.objectId, record.eventCount, record.actorCount,
+                Format::fromRecord(record.timestamp) }, i >= firstUnread, openActors);
+        }
+    }
+
+    size_t conversationCount;
+    const Format::ConversationRecord* conversations = reader.array<Format::ConversationRecord>(Format::CONVERSATIONS, 0,
+        conversationCount);
+    SnapshotReader::Lists<Format::MessageRecord> messages(reader, Format::MESSAGES_INDEX, Format::MESSAGES,
+        conversationCount);
+    for (size_t i = 0; i < conversationCount; ++i) {
+        const Format::ConversationRecord& record = conversations[i];
+        size_t items;
+        const Format::MessageRecord* message = messages.items(i, items);
+        uint64_t lastNumber = record.firstNumber + items - 1;
+        if (items == 0 || lastNumber < record.firstNumber || items > MessageStore::CHUNK_SIZE * MessageStore::RETAINED_CHUNKS || record.firstNumber == 0 ||
+            (record.firstNumber - 1) % MessageStore::CHUNK_SIZE != 0 || record.users[0] > record.users[1] ||
+            record.readThrough[0] > lastNumber || record.readThrough[1] > lastNumber) {
+            throw runtime_error("Corrupt snapshot: bad conversation");
+        }
+        vector<Message> kept;
+        kept.reserve(items);
+        for (size_t j = 0; j < items; ++j) {
+            if (message[j].senderId != record.users[0] && message[j].senderId != record.users[1]) {
+                throw runtime_error("Corrupt snapshot: message sender outside its conversation");
+            }
+            kept.push_back(Message{ message[j].senderId, string(reader.text(message[j].content)),
+                Format::fromRecord(message[j].timestamp) });
+        }
+        if (!messageStore.restore(checkUser(record.users[0]), checkUser(record.users[1]), record.firstNumber,
+            record.readThrough, std::move(kept))) {
+            throw runtime_error("Corrupt snapshot: duplicate conversation");
+        }
+    }
+}
+
+void SocialNetworkGraph::openLog(const string& path) {
+    journal.reset(new WriteAheadLog(path, snapshotSequence, [this](WriteAheadLog::RecordReader& record) {
+        applyLogRecord(record);
+    }));
+}
+
+void SocialNetworkGraph::applyLogRecord(WriteAheadLog::RecordReader& record) {
+    auto user = [this](int id) {
+        if (id < 0 || id >= userCount()) {
+            throw runtime_error("Corrupt log: user ID out of range");
+        }
+        return nodes[id];
+    };
+
+    // Replayed mutations take their timestamps from the record
+    CustomTime::pinned() = &record.time;
+    try {
+        switch (record.type) {
+        case WriteAheadLog::ADD_USER: {
+            string name = record.text();
+            string password = record.text();
+            string securityQuestion = record.text();
+            string securityAnswer = record.text();
+            string city = record.text();
+            if (!addUser(new GraphNode(new UserProfile(name, password, securityQuestion, securityAnswer, city)))) {
+                throw runtime_error("Corrupt log: duplicate username " + name);
+            }
+            break;
+        }
+        case WriteAheadLog::FOLLOW_REQUEST: {
+            GraphNode* requester = user(record.id());
+            GraphNode* target = user(record.id());
+            requester->user->sendFollowRequest(requester, target);
+            break;
+        }
+        case WriteAheadLog::ACCEPT_REQUEST: {
+            GraphNode* accepter = user(record.id());
+            GraphNode* requester = user(record.id());
+            accepter->user->acceptFollowRequest(accepter, requester);
+            break;
+        }
+        case WriteAheadLog::CREATE_POST: {
+            GraphNode* author = user(record.id());
+            uint64_t postId = record.number();
+            if (author->user->createPost(record.text()) != postId) {
+                throw runtime_error("Corrupt log: post ID out of order");
+            }
+            break;
+        }
+        case WriteAheadLog::SEND_MESSAGE: {
+            GraphNode* sender = user(record.id());
+            GraphNode* recipient = user(record.id());
+            sender->user->sendMessage(recipient->user, record.text());
+            break;
+        }
+        case WriteAheadLog::REJECT_REQUEST: {
+            GraphNode* rejecter = user(record.id());
+            GraphNode* requester = user(record.id());
+            rejecter->user->rejectFollowRequest(rejecter, requester);
+            break;
+        }
+        case WriteAheadLog::ACCEPT_ALL_REQUESTS: {
+            GraphNode* accepter = user(record.id());
+            accepter->user->acceptAllFollowRequests(accepter);
+            break;
+        }
+        case WriteAheadLog::RESET_PASSWORD: {
+            GraphNode* target = user(record.id());
+            resetPassword(target, record.text());
+            break;
+        }
+        default:
+            throw runtime_error("Corrupt log: unknown record type");
+        }
+    }
+    catch (...) {
+        CustomTime::pinned() = nullptr;
+        throw;
+    }
+    CustomTime::pinned() = nullptr;
+}
+
+// Bulk import
+long long SocialNetworkGraph::importNetwork(const string& usersPath, const string& edgesPath, int threadCount) {
+    typedef ParallelLineScanner Scanner;
+    if (userCount() != 0 || journal) {
+        throw runtime_error("Networks can only be imported into an empty network with no log");
+    }
+    int threads = threadCount > 0 ? threadCount : Scanner::defaultThreads();
+
+    vector<UserProfile*> users;
+    vector<vector<UserProfile*>> parsed(threads);
+    vector<int> outLength, inLength;
+    vector<size_t> outStart, inStart;
+    vector<int> outRows, inRows;
+    int count = 0;
+    try {
+        // Users are numbered from 0 in file order
+        vector<vector<string>> fields(threads);
+        Scanner::scan(usersPath, threads, [&](int worker, const char* begin, const char* end) -> const char* {
+            vector<string>& row = fields[worker];
+            if (!Scanner::splitCsv(begin, end, row)) {
+                return "unterminated quote";
+            }
+            if (row.size() > 5) {
+                return "expected at most 5 fields";
+            }
+            if (row[0].empty()) {
+                return "empty username";
+            }
+            row.resize(5);
+            parsed[worker].push_back(new UserProfile(row[0], row[1], row[3], row[4], row[2]));
+            return nullptr;
+        }, [&](int worker) {
+            users.insert(users.end(), parsed[worker].begin(), parsed[worker].end());
+            parsed[worker].clear();
+        });
+        if (users.size() > static_cast<size_t>(numeric_limits<int>::max())) {
+            throw runtime_error("Too many users in " + usersPath);
+        }
+        count = static_cast<int>(users.size());
+
+        // Each name shard is filled by one thread
+        vector<uint64_t> hashes(count);
+        Scanner::parallelFor(threads, hashes.size(), [&](size_t begin, size_t end) {
+            for (size_t id = begin; id < end; ++id) {
+                hashes[id] = UsernameIndex::hashName(users[id]->name);
+            }
+        });
+        vector<int> duplicates(SHARD_COUNT, -1);
+        Scanner::parallelFor(threads, SHARD_COUNT, [&](size_t begin, size_t end) {
+            for (size_t shard = begin; shard < end; ++shard) {
+                UsernameIndex& index = nameShards[shard].index;
+                index.reserve(count / SHARD_COUNT);
+                for (int id = 0; id < count; ++id) {
+                    if (nameShardOf(hashes[id]) != static_cast<int>(shard)) {
+                        continue;
+                    }
+                    if (index.find(users[id]->name, hashes[id], [&users](int candidate) -> const string& {
+                        return users[candidate]->name;
+                    }) >= 0) {
+                        duplicates[shard] = id;
+                        break;
+                    }
+                    index.insert(hashes[id], id);
+                }
+            }
+        });
+        for (int id : duplicates) {
+            if (id >= 0) {
+                throw runtime_error("Duplicate username " + users[id]->name + " in " + usersPath);
+            }
+        }
+
+        // Each edge line is "follower followee" by user number. Pass one
+        // counts every user's out- and in-degree, pass two drops each edge
+        // straight into its slot (a counting sort), so the edge list itself
+        // is never held in memory.
+        auto parseEdge = [count](const char* at, const char* end, int& follower, int& followee) -> const char* {
+            long long ids[2];
+            for (long long& id : ids) {
+                while (at < end && (*at == ' ' || *at == '\t' || *at == ',')) {
+                    ++at;
+                }
+                if (at == end || *at < '0' || *at > '9') {
+                    return "expected two user numbers";
+                }
+                id = 0;
+                while (at < end && *at >= '0' && *at <= '9') {
+                    id = id * 10 + (*at++ - '0');
+                    if (id >= count) {
+                        return "user number out of range";
+                    }
+                }
+            }
+            while (at < end && (*at == ' ' || *at == '\t')) {
+                ++at;
+            }
+            if (at != end) {
+                return "expected two user numbers";
+            }
+            follower = static_cast<int>(ids[0]);
+            followee = static_cast<int>(ids[1]);
+            return nullptr;
+        };
+
+        unique_ptr<atomic<int>[]> outCursor(new atomic<int>[count + 1]);
+        unique_ptr<atomic<int>[]> inCursor(new atomic<int>[count + 1]);
+        for (int id = 0; id <= count; ++id) {
+            outCursor[id].store(0, memory_order_relaxed);
+            inCursor[id].store(0, memory_order_relaxed);
+        }
+        Scanner::scan(edgesPath, threads, [&](int, const char* begin, const char* end) -> const char* {
+            int follower, followee;
+            const char* error = parseEdge(begin, end, follower, followee);
+            if (!error && follower != followee) {
+                outCursor[follower].fetch_add(1, memory_order_relaxed);
+                inCursor[followee].fetch_add(1, memory_order_relaxed);
+            }
+            return error;
+        }, [](int) {});
+
+        outStart.assign(count + 1, 0);
+        inStart.assign(count + 1, 0);
+        for (int id = 0; id < count; ++id) {
+            outStart[id + 1] = outStart[id] + outCursor[id].exchange(0, memory_order_relaxed);
+            inStart[id + 1] = inStart[id] + inCursor[id].exchange(0, memory_order_relaxed);
+        }
+        outRows.resize(outStart[count]);
+        inRows.resize(inStart[count]);
+        Scanner::scan(edgesPath, threads, [&](int, const char* begin, const char* end) -> const char* {
+            int follower, followee;
+            const char* error = parseEdge(begin, end, follower, followee);
+            if (error || follower == followee) {
+                return error;
+            }
+            size_t outSlot = outStart[follower] + outCursor[follower].fetch_add(1, memory_order_relaxed);
+            size_t inSlot = inStart[followee] + inCursor[followee].fetch_add(1, memory_order_relaxed);
+            if (outSlot >= outStart[follower + 1] || inSlot >= inStart[followee + 1]) {
+                return "edge list changed during import";
+            }
+            outRows[outSlot] = followee;
+            inRows[inSlot] = follower;
+            return nullptr;
+        }, [](int) {});
+
+        // Sorted, duplicate-free rows
+        outLength.resize(count);
+        inLength.resize(count);
+        Scanner::parallelFor(threads, count, [&](size_t begin, size_t end) {
+            for (size_t id = begin; id < end; ++id) {
+                int* row = outRows.data() + outStart[id];
+                sort(row, outRows.data() + outStart[id + 1]);
+                outLength[id] = static_cast<int>(unique(row, outRows.data() + outStart[id + 1]) - row);
+                row = inRows.data() + inStart[id];
+                sort(row, inRows.data() + inStart[id + 1]);
+                inLength[id] = static_cast<int>(unique(row, inRows.data() + inStart[id + 1]) - row);
+            }
+        });
+    }
+    catch (...) {
+        for (NameShard& nameShard : nameShards) {
+            nameShard.index = UsernameIndex();
+        }
+        for (const vector<UserProfile*>& pending : parsed) {
+            users.insert(users.end(), pending.begin(), pending.end());
+        }
+        for (UserProfile* user : users) {
+            delete user;
+        }
+        throw;
+    }
+
+    for (int id = 0; id < count; ++id) {
+        GraphNode* node = new GraphNode(users[id]);
+        node->id = id;
+        node->network = this;
+        nodes.ensure(id) = node;
+        suggestionCache.addUser(id);
+        postStore.addUser(id);
+        newsfeed.addUser(id);
+        messageStore.addUser(id);
+        cityIndex.addUser(id, users[id]->city);
+        adjacency.addVertex(id);
+    }
+
+    // A connection joins every follower and followee, in either direction
+    Scanner::parallelFor(threads, SHARD_COUNT, [&](size_t begin, size_t end) {
+        for (size_t shard = begin; shard < end; ++shard) {
+            vector<int> offsets(1, 0);
+            vector<int> neighbors;
+            for (int id = static_cast<int>(shard); id < count; id += SHARD_COUNT) {
+                const int* out = outRows.data() + outStart[id];
+                const int* in = inRows.data() + inStart[id];
+                set_union(out, out + outLength[id], in, in + inLength[id], back_inserter(neighbors));
+                offsets.push_back(static_cast<int>(neighbors.size()));
+            }
+            adjacency.shard(static_cast<int>(shard)).adopt(std::move(offsets), std::move(neighbors));
+        }
+    });
+
+    Scanner::parallelFor(threads, count, [&](size_t begin, size_t end) {
+        for (size_t id = begin; id < end; ++id) {
+            UserProfile* user = users[id];
+            const int* in = inRows.data() + inStart[id];
+            const int* out = outRows.data() + outStart[id];
+            user->followers.reserve(inLength[id]);
+            for (const int* follower = in; follower < in + inLength[id]; ++follower) {
+                user->followers.enqueue(users[*follower]);
+            }
+            user->following.reserve(outLength[id]);
+            user->node->followees.reserve(outLength[id]);
+            for (const int* followee = out; followee < out + outLength[id]; ++followee) {
+                user->following.enqueue(users[*followee]);
+                user->node->followees.add(*followee);
+            }
+            newsfeed.importFollowers(static_cast<int>(id), vector<int>(in, in + inLength[id]));
+        }
+    });
+
+    registeredUsers.store(count, memory_order_release);
+    long long follows = 0;
+    for (int length : outLength) {
+        follows += length;
     }
+    return follows;
 }
 
 class BSTNode {
@@ -654,149 +5601,324 @@ public:
     UserProfile* user;
     BSTNode* left;
     BSTNode* right;
+    int height;
 
     BSTNode(UserProfile* userProfile);
 };
 
+// Height-balanced (AVL) username index. Nodes come from a chunked arena
+// that is released as a whole, and every operation is iterative, so sorted
+// or adversarial signup orders neither degrade lookups nor grow the stack.
 class UserSearchBST {
 private:
+    // AVL height is below 1.45 * log2(n + 2), so 64 levels cover any tree
+    static constexpr int MAX_HEIGHT = 64;
+    static constexpr int CHUNK_SIZE = 1024;
+
     BSTNode* root;
-    BSTNode* insertRecursive(BSTNode* node, UserProfile* user);
-    UserProfile* searchRecursive(BSTNode* node, const string& username) const;
-    void inorderTraversalRecursive(BSTNode* node) const;
-    void deleteTreeRecursive(BSTNode* node);
+    vector<BSTNode*> chunks;
+    int usedInChunk;
+    int nodeCount;
+
+    BSTNode* allocateNode(UserProfile* user);
+    static int height(BSTNode* node);
+    static void updateHeight(BSTNode* node);
+    static BSTNode* rotateLeft(BSTNode* node);
+    static BSTNode* rotateRight(BSTNode* node);
+    static BSTNode* rebalance(BSTNode* node);
+    BSTNode* buildBalanced(UserProfile* const* users, size_t count);
 
 public:
     UserSearchBST();
     ~UserSearchBST();
 
     void addUser(UserProfile* user);
+    // Fills an empty tree with users in one pass, building it perfectly
+    // balanced from the sorted names instead of inserting one at a time
+    void build(vector<UserProfile*> users);
     UserProfile* findUser(const string& username) const;
+    int size() const;
+
+    // In-order walk over names in [low, high); an empty high means no upper
+    // bound. The visitor returns false to stop early.
+    template <typename Visitor>
+    void forEachInRange(const string& low, const string& high, Visitor&& visit) const;
+
+    template <typename Visitor>
+    void forEachWithPrefix(const string& prefix, Visitor&& visit) const;
+
     void displayAllUsers() const;
 };
 
 // BSTNode constructor
 BSTNode::BSTNode(UserProfile* userProfile) :
-    user(userProfile), left(nullptr), right(nullptr) {}
+    user(userProfile), left(nullptr), right(nullptr), height(1) {}
 
 // UserSearchBST constructor
-UserSearchBST::UserSearchBST() : root(nullptr) {}
+UserSearchBST::UserSearchBST() : root(nullptr), usedInChunk(CHUNK_SIZE), nodeCount(0) {}
 
 // UserSearchBST destructor
 UserSearchBST::~UserSearchBST() {
-    deleteTreeRecursive(root);
+    for (BSTNode* chunk : chunks) {
+        ::operator delete(chunk);
+    }
 }
 
-// Recursive insert implementation
-BSTNode* UserSearchBST::insertRecursive(BSTNode* node, UserProfile* user) {
-    // Standard BST insertion
-    if (node == nullptr) {
-        return new BSTNode(user);
+BSTNode* UserSearchBST::allocateNode(UserProfile* user) {
+    if (usedInChunk == CHUNK_SIZE) {
+        chunks.push_back(static_cast<BSTNode*>(::operator new(sizeof(BSTNode) * CHUNK_SIZE)));
+        usedInChunk = 0;
     }
+    return new (chunks.back() + usedInChunk++) BSTNode(user);
+}
 
-    // Compare usernames to determine insertion path
-    if (user->name < node->user->name) {
-        node->left = insertRecursive(node->left, user);
-    }
-    else if (user->name > node->user->name) {
-        node->right = insertRecursive(node->right, user);
-    }
-    else {
-        // Username already exists
-        cout << "User '" << user->name << "' already exists in the tree." << endl;
-        return node;
-    }
+int UserSearchBST::height(BSTNode* node) {
+    return node ? node->height : 0;
+}
 
-    return node;
+void UserSearchBST::updateHeight(BSTNode* node) {
+    node->height = 1 + max(height(node->left), height(node->right));
 }
 
-// Recursive search implementation
-UserProfile* UserSearchBST::searchRecursive(BSTNode* node, const string& username) const {
-    // Base cases
-    if (node == nullptr) {
-        return nullptr;
-    }
+BSTNode* UserSearchBST::rotateLeft(BSTNode* node) {
+    BSTNode* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    updateHeight(node);
+    updateHeight(pivot);
+    return pivot;
+}
 
-    // If username matches
-    if (node->user->name == username) {
-        return node->user;
-    }
+BSTNode* UserSearchBST::rotateRight(BSTNode* node) {
+    BSTNode* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    updateHeight(node);
+    updateHeight(pivot);
+    return pivot;
+}
 
-    // Recursive search in left or right subtree
-    if (username < node->user->name) {
-        return searchRecursive(node->left, username);
+BSTNode* UserSearchBST::rebalance(BSTNode* node) {
+    updateHeight(node);
+    int balance = height(node->left) - height(node->right);
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotateLeft(node->left);
+        }
+        return rotateRight(node);
     }
-    else {
-        return searchRecursive(node->right, username);
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotateRight(node->right);
+        }
+        return rotateLeft(node);
     }
+    return node;
 }
 
-// Inorder traversal implementation
-void UserSearchBST::inorderTraversalRecursive(BSTNode* node) const {
-    if (node == nullptr) {
-        return;
+// Public method implementations
+void UserSearchBST::addUser(UserProfile* user) {
+    // Record the link followed at each level so the path can be rebalanced bottom-up
+    BSTNode** path[MAX_HEIGHT];
+    int depth = 0;
+    BSTNode** link = &root;
+
+    while (*link) {
+        BSTNode* node = *link;
+        if (user->name == node->user->name) {
+            // Username already exists
+            cout << "User '" << user->name << "' already exists in the tree." << endl;
+            return;
+        }
+        path[depth++] = link;
+        link = user->name < node->user->name ? &node->left : &node->right;
     }
 
-    // Left subtree
-    inorderTraversalRecursive(node->left);
+    *link = allocateNode(user);
+    ++nodeCount;
 
-    // Current node
-    if (node->user) {
-        cout << node->user->getProfileInfo() << "\n---\n";
+    while (depth > 0) {
+        BSTNode** parentLink = path[--depth];
+        int before = (*parentLink)->height;
+        *parentLink = rebalance(*parentLink);
+        if ((*parentLink)->height == before) {
+            break;
+        }
     }
+}
 
-    // Right subtree
-    inorderTraversalRecursive(node->right);
+BSTNode* UserSearchBST::buildBalanced(UserProfile* const* users, size_t count) {
+    if (count == 0) {
+        return nullptr;
+    }
+    size_t middle = count / 2;
+    BSTNode* node = allocateNode(users[middle]);
+    node->left = buildBalanced(users, middle);
+    node->right = buildBalanced(users + middle + 1, count - middle - 1);
+    updateHeight(node);
+    return node;
 }
 
-// Tree deletion implementation
-void UserSearchBST::deleteTreeRecursive(BSTNode* node) {
-    if (node == nullptr) {
-        return;
+void UserSearchBST::build(vector<UserProfile*> users) {
+    if (root) {
+        throw runtime_error("Only an empty search tree can be built in bulk");
     }
+    auto byName = [](const UserProfile* a, const UserProfile* b) { return a->name < b->name; };
+    sort(users.begin(), users.end(), byName);
+    users.erase(unique(users.begin(), users.end(), [](const UserProfile* a, const UserProfile* b) {
+        return a->name == b->name;
+    }), users.end());
+    root = buildBalanced(users.data(), users.size());
+    nodeCount = static_cast<int>(users.size());
+}
 
-    // Recursively delete left and right subtrees
-    deleteTreeRecursive(node->left);
-    deleteTreeRecursive(node->right);
+UserProfile* UserSearchBST::findUser(const string& username) const {
+    BSTNode* node = root;
+    while (node) {
+        int cmp = username.compare(node->user->name);
+        if (cmp == 0) {
+            return node->user;
+        }
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return nullptr;
+}
 
-    // Delete the current node
-    delete node;
+int UserSearchBST::size() const {
+    return nodeCount;
 }
 
-// Public method implementations
-void UserSearchBST::addUser(UserProfile* user) {
-    root = insertRecursive(root, user);
+template <typename Visitor>
+void UserSearchBST::forEachInRange(const string& low, const string& high, Visitor&& visit) const {
+    BSTNode* stack[MAX_HEIGHT];
+    int top = 0;
+
+    // Seed the stack with the path to the first name >= low
+    BSTNode* node = root;
+    while (node) {
+        if (node->user->name < low) {
+            node = node->right;
+        }
+        else {
+            stack[top++] = node;
+            node = node->left;
+        }
+    }
+
+    while (top > 0) {
+        node = stack[--top];
+        if (!high.empty() && node->user->name >= high) {
+            return;
+        }
+        if (!visit(node->user)) {
+            return;
+        }
+        for (node = node->right; node; node = node->left) {
+            stack[top++] = node;
+        }
+    }
 }
 
-UserProfile* UserSearchBST::findUser(const string& username) const {
-    return searchRecursive(root, username);
+template <typename Visitor>
+void UserSearchBST::forEachWithPrefix(const string& prefix, Visitor&& visit) const {
+    forEachInRange(prefix, "", [&](UserProfile* user) {
+        if (user->name.compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+        return visit(user);
+    });
 }
 
 void UserSearchBST::displayAllUsers() const {
     cout << "--- User List ---\n";
-    inorderTraversalRecursive(root);
+    forEachInRange("", "", [](UserProfile* user) {
+        cout << user->getProfileInfo() << "\n---\n";
+        return true;
+    });
     cout << "-----------------\n";
 }
 
 class SocialNetworkApp {
 private:
+    static constexpr int MAX_SEARCH_RESULTS = 10;
+
     SocialNetworkGraph socialNetwork;
     UserSearchBST userSearch;
     UserAuthenticator authenticator;
     GraphNode* currentUser;
 
-    void searchUser() {
-        string username;
-        cout << "Enter username to search: ";
-        cin >> username;
+    void searchUser() {
+        string username;
+        cout << "Enter username to search: ";
+        cin >> username;
+
+        GraphNode* userNode = socialNetwork.findUser(username);
+        if (userNode) {
+            cout << "User found:\n" << userNode->user->getProfileInfo() << "\n";
+            return;
+        }
+
+        // Fall back to a typeahead-style prefix match
+        int shown = 0;
+        userSearch.forEachWithPrefix(username, [&](UserProfile* user) {
+            if (shown == 0) {
+                cout << "Users starting with '" << username << "':\n";
+            }
+            cout << ++shown << ". " << user->name << "\n";
+            return shown < MAX_SEARCH_RESULTS;
+        });
+        if (shown == 0) {
+            cout << "User not found.\n";
+        }
+    }
+
+    void searchPosts() {
+        string query;
+        cout << "Enter words to search for: ";
+        getline(cin, query);
+
+        uint64_t cursor = 0;
+        do {
+            PostIndex::Page page = socialNetwork.searchPosts(query, cursor, UserProfile::FEED_PAGE_SIZE);
+            if (cursor == 0 && page.postIds.empty()) {
+                cout << "No posts found." << endl;
+            }
+            for (uint64_t postId : page.postIds) {
+                cout << socialNetwork.formatPost(postId) << endl;
+            }
+            cursor = page.nextCursor;
+            if (cursor != 0) {
+                char more;
+                cout << "Load more results? (y/n): ";
+                cin >> more;
+                cin.ignore();
+                if (more != 'y' && more != 'Y') {
+                    break;
+                }
+            }
+        } while (cursor != 0);
+    }
 
-        UserProfile* user = userSearch.findUser(username);
-        if (user) {
-            cout << "User found:\n" << user->getProfileInfo() << "\n";
+    void peopleNearYou() {
+        string city;
+        cout << "Enter city (leave blank for " << currentUser->user->city << "): ";
+        getline(cin, city);
+        if (city.empty()) {
+            city = currentUser->user->city;
         }
-        else {
-            cout << "User not found.\n";
+
+        vector<pair<GraphNode*, int>> nearby = socialNetwork.nearbyInCity(currentUser, city);
+        cout << "--- People in " << city << " you know ---" << endl;
+        if (nearby.empty()) {
+            cout << "No friends or friends of friends there." << endl;
+        }
+        int index = 1;
+        for (const pair<GraphNode*, int>& person : nearby) {
+            cout << index++ << ". " << person.first->user->name
+                << (person.second == 1 ? " (friend)" : " (friend of a friend)") << endl;
         }
+        socialNetwork.suggestMutualFriends(currentUser, SocialNetworkGraph::DEFAULT_SUGGESTIONS,
+            SocialNetworkGraph::SAME_CITY_BONUS);
     }
 
     void displayMainMenu() {
@@ -817,7 +5939,9 @@ private:
         cout << "6. Messaging" << endl;
         cout << "7. Search Users" << endl;
         cout << "8. View Followers" << endl;
-        cout << "9. Logout" << endl;
+        cout << "9. Search Posts" << endl;
+        cout << "10. People Near You" << endl;
+        cout << "11. Logout" << endl;
         cout << "Enter your choice: ";
     }
 
@@ -859,7 +5983,13 @@ private:
     void signupProcess() {
         UserProfile* newUser = createUserProfile();
         GraphNode* newUserNode = new GraphNode(newUser);
-        socialNetwork.addUser(newUserNode);
+        if (!socialNetwork.addUser(newUserNode)) {
+            cout << "Username already exists. Signup failed." << endl;
+            delete newUserNode;
+            delete newUser;
+            return;
+        }
+        userSearch.addUser(newUser);
         cout << "Signup successful!" << endl;
     }
 
@@ -879,7 +6009,7 @@ private:
             cout << "Enter password: ";
             getline(cin, password);
 
-            if (userNode->user->password == password) {
+            if (socialNetwork.verifyPassword(userNode, password)) {
                 currentUser = userNode;
                 cout << "Login successful!" << endl;
                 return true;
@@ -903,7 +6033,7 @@ private:
                     getline(cin, newPassword);
 
                     if (authenticator.validatePassword(newPassword)) {
-                        userNode->user->password = newPassword;
+                        socialNetwork.resetPassword(userNode, newPassword);
                         cout << "Password reset successful!" << endl;
                         return false;
                     }
@@ -921,8 +6051,10 @@ private:
         while (true) {
             cout << "\n--- Follow Requests Menu ---" << endl;
             cout << "1. View Pending Requests" << endl;
-            cout << "2. Accept Requests" << endl;
-            cout << "3. Back to Main Menu" << endl;
+            cout << "2. Accept Request" << endl;
+            cout << "3. Reject Request" << endl;
+            cout << "4. Accept All Requests" << endl;
+            cout << "5. Back to Main Menu" << endl;
             cout << "Enter your choice: ";
 
             int choice;
@@ -930,18 +6062,36 @@ private:
             cin.ignore();
 
             switch (choice) {
-            case 1:
-                currentUser->user->displayPendingRequests(currentUser);
+            case 1: {
+                uint64_t cursor = currentUser->user->displayPendingRequests(currentUser);
+                while (cursor != 0) {
+                    char more;
+                    cout << "Load more requests? (y/n): ";
+                    cin >> more;
+                    cin.ignore();
+                    if (more != 'y' && more != 'Y') {
+                        break;
+                    }
+                    cursor = currentUser->user->displayPendingRequests(currentUser, cursor);
+                }
                 break;
-            case 2: {
-                int requestIndex;
-                cout << "Enter request number to accept: ";
-                cin >> requestIndex;
-                cin.ignore();
-                currentUser->user->acceptFollowRequest(currentUser, requestIndex);
+            }
+            case 2:
+            case 3: {
+                string requesterName;
+                cout << "Enter username of the request to " << (choice == 2 ? "accept" : "reject") << ": ";
+                getline(cin, requesterName);
+                GraphNode* requesterNode = socialNetwork.findUser(requesterName);
+                bool handled = requesterNode && (choice == 2 ?
+                    currentUser->user->acceptFollowRequest(currentUser, requesterNode) :
+                    currentUser->user->rejectFollowRequest(currentUser, requesterNode));
+                cout << (handled ? "Done." : "No pending request from that user.") << endl;
                 break;
             }
-            case 3:
+            case 4:
+                cout << "Accepted " << currentUser->user->acceptAllFollowRequests(currentUser) << " requests." << endl;
+                break;
+            case 5:
                 return;
             default:
                 cout << "Invalid choice. Try again." << endl;
@@ -956,15 +6106,19 @@ private:
 
         GraphNode* targetNode = socialNetwork.findUser(targetUsername);
         if (targetNode) {
-            currentUser->user->sendFollowRequest(currentUser, targetNode);
-            cout << "Follow request sent to " << targetUsername << endl;
+            if (currentUser->user->sendFollowRequest(currentUser, targetNode)) {
+                cout << "Follow request sent to " << targetUsername << endl;
+            }
+            else {
+                cout << "Already following or requested " << targetUsername << endl;
+            }
         }
         else {
             cout << "User not found." << endl;
         }
     }
 
-    void messagingMenu() {
+    void sendMessage() {
         string recipientUsername, message;
         cout << "Enter recipient username: ";
         getline(cin, recipientUsername);
@@ -981,10 +6135,473 @@ private:
         }
     }
 
+    void openConversation() {
+        string partnerUsername;
+        cout << "Enter username: ";
+        getline(cin, partnerUsername);
+
+        GraphNode* partnerNode = socialNetwork.findUser(partnerUsername);
+        if (!partnerNode) {
+            cout << "User not found." << endl;
+            return;
+        }
+        uint64_t cursor = currentUser->user->displayConversation(partnerNode);
+        while (cursor != 0) {
+            char more;
+            cout << "Load older messages? (y/n): ";
+            cin >> more;
+            cin.ignore();
+            if (more != 'y' && more != 'Y') {
+                break;
+            }
+            cursor = currentUser->user->displayConversation(partnerNode, cursor);
+        }
+    }
+
+    void messagingMenu() {
+        while (true) {
+            cout << "\n--- Messaging Menu ---" << endl;
+            cout << "1. View Inbox" << endl;
+            cout << "2. Open Conversation" << endl;
+            cout << "3. Send Message" << endl;
+            cout << "4. Back to Main Menu" << endl;
+            cout << "Enter your choice: ";
+
+            int choice;
+            cin >> choice;
+            cin.ignore();
+
+            switch (choice) {
+            case 1:
+                currentUser->user->displayInbox();
+                break;
+            case 2:
+                openConversation();
+                break;
+            case 3:
+                sendMessage();
+                break;
+            case 4:
+                return;
+            default:
+                cout << "Invalid choice. Try again." << endl;
+            }
+        }
+    }
+
+    // Output sink for batch mode. Lines are collected in memory and written
+    // out in large blocks instead of being flushed one by one.
+    class BatchOutput {
+    private:
+        static constexpr size_t FLUSH_THRESHOLD = 1 << 16;
+
+        ostream& sink;
+        string buffer;
+
+    public:
+        explicit BatchOutput(ostream& target) : sink(target) {
+            buffer.reserve(FLUSH_THRESHOLD * 2);
+        }
+
+        BatchOutput& operator<<(string_view text) {
+            buffer.append(text.data(), text.size());
+            return *this;
+        }
+
+        BatchOutput& operator<<(char ch) {
+            buffer.push_back(ch);
+            if (ch == '\n' && buffer.size() >= FLUSH_THRESHOLD) {
+                flush();
+            }
+            return *this;
+        }
+
+        BatchOutput& operator<<(uint64_t value) {
+            char digits[24];
+            int length = snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value));
+            buffer.append(digits, length);
+            return *this;
+        }
+
+        BatchOutput& operator<<(int value) {
+            char digits[16];
+            int length = snprintf(digits, sizeof(digits), "%d", value);
+            buffer.append(digits, length);
+            return *this;
+        }
+
+        void flush() {
+            sink.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+
+        ~BatchOutput() {
+            flush();
+            sink.flush();
+        }
+    };
+
+    // Looks up a user named in a batch command, reporting a missing one
+    GraphNode* batchUser(const string& username, const string& command, BatchOutput& out) {
+        GraphNode* userNode = socialNetwork.findUser(username);
+        if (!userNode) {
+            out << command << " error unknown user " << username << '\n';
+        }
+        return userNode;
+    }
+
+    // Runs one batch command. Every command writes at least one line that
+    // starts with the command name.
+    void executeCommand(const string& line, BatchOutput& out) {
+        istringstream fields(line);
+        string command;
+        if (!(fields >> command) || command[0] == '#') {
+            return;
+        }
+
+        // Free text (post and message bodies) is the rest of the line
+        auto restOfLine = [&fields]() {
+            string text;
+            getline(fields >> ws, text);
+            return text;
+        };
+
+        if (command == "signup") {
+            string name, password;
+            fields >> name >> password;
+            string city = restOfLine();
+            if (name.empty() || password.empty()) {
+                out << "signup error usage: signup <name> <password> [city]" << '\n';
+                return;
+            }
+            if (!authenticator.isValidPassword(password)) {
+                out << "signup error weak password " << name << '\n';
+                return;
+            }
+            UserProfile* newUser = new UserProfile(name, password, "", "", city);
+            GraphNode* newUserNode = new GraphNode(newUser);
+            if (!socialNetwork.addUser(newUserNode)) {
+                delete newUserNode;
+                delete newUser;
+                out << "signup error username taken " << name << '\n';
+                return;
+            }
+            userSearch.addUser(newUser);
+            out << "signup ok " << name << '\n';
+        }
+        else if (command == "follow") {
+            string requester, target;
+            fields >> requester >> target;
+            GraphNode* requesterNode = batchUser(requester, command, out);
+            GraphNode* targetNode = requesterNode ? batchUser(target, command, out) : nullptr;
+            if (targetNode == requesterNode) {
+                out << "follow error cannot follow yourself" << '\n';
+            }
+            else if (targetNode) {
+                if (requesterNode->user->sendFollowRequest(requesterNode, targetNode)) {
+                    out << "follow ok " << requester << ' ' << target << '\n';
+                }
+                else {
+                    out << "follow error already following or requested " << target << '\n';
+                }
+            }
+        }
+        else if (command == "accept") {
+            string username, requester;
+            fields >> username >> requester;
+            GraphNode* userNode = batchUser(username, command, out);
+            GraphNode* requesterNode = userNode ? batchUser(requester, command, out) : nullptr;
+            if (requesterNode) {
+                if (userNode->user->acceptFollowRequest(userNode, requesterNode)) {
+                    out << "accept ok " << username << ' ' << requester << '\n';
+                }
+                else {
+                    out << "accept error no pending request from " << requester << '\n';
+                }
+            }
+        }
+        else if (command == "reject") {
+            string username, requester;
+            fields >> username >> requester;
+            GraphNode* userNode = batchUser(username, command, out);
+            GraphNode* requesterNode = userNode ? batchUser(requester, command, out) : nullptr;
+            if (requesterNode) {
+                if (userNode->user->rejectFollowRequest(userNode, requesterNode)) {
+                    out << "reject ok " << username << ' ' << requester << '\n';
+                }
+                else {
+                    out << "reject error no pending request from " << requester << '\n';
+                }
+            }
+        }
+        else if (command == "acceptall") {
+            string username;
+            fields >> username;
+            GraphNode* userNode = batchUser(username, command, out);
+            if (userNode) {
+                auto accepted = userNode->user->acceptAllFollowRequests(userNode);
+                out << "acceptall ok " << username << ' ' << accepted << '\n';
+            }
+        }
+        else if (command == "requests") {
+            string username;
+            int limit = UserProfile::REQUEST_PAGE_SIZE;
+            uint64_t after = 0;
+            fields >> username;
+            if (fields >> limit) {
+                fields >> after;
+            }
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            vector<int> requesters;
+            uint64_t next;
+            {
+                SocialNetworkGraph::ShardGuard guard = socialNetwork.readLock(userNode);
+                next = userNode->pendingRequests.page(after, max(0, limit), requesters);
+            }
+            out << "requests " << username << ' ' << static_cast<int>(requesters.size()) << " next " << next;
+            for (int id : requesters) {
+                out << ' ' << socialNetwork.getUser(id)->user->name;
+            }
+            out << '\n';
+        }
+        else if (command == "post") {
+            string author;
+            fields >> author;
+            GraphNode* authorNode = batchUser(author, command, out);
+            if (authorNode) {
+                auto postId = authorNode->user->createPost(restOfLine());
+                out << "post ok " << postId << '\n';
+            }
+        }
+        else if (command == "message") {
+            string sender, recipient;
+            fields >> sender >> recipient;
+            GraphNode* senderNode = batchUser(sender, command, out);
+            GraphNode* recipientNode = senderNode ? batchUser(recipient, command, out) : nullptr;
+            if (recipientNode) {
+                senderNode->user->sendMessage(recipientNode->user, restOfLine());
+                out << "message ok " << sender << ' ' << recipient << '\n';
+            }
+        }
+        else if (command == "inbox") {
+            string username;
+            fields >> username;
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            vector<MessageStore::Summary> conversations = socialNetwork.readInbox(userNode);
+            uint64_t unread = 0;
+            for (const MessageStore::Summary& conversation : conversations) {
+                unread += conversation.unread;
+            }
+            out << "inbox " << username << ' ' << static_cast<int>(conversations.size()) << " unread " << unread << '\n';
+            for (const MessageStore::Summary& conversation : conversations) {
+                out << "  " << socialNetwork.getUser(conversation.partnerId)->user->name << " unread " << conversation.unread
+                    << " last " << socialNetwork.getUser(conversation.last.senderId)->user->name << ": "
+                    << conversation.last.content << '\n';
+            }
+        }
+        else if (command == "messages") {
+            string username, partner;
+            int limit = UserProfile::MESSAGE_PAGE_SIZE;
+            uint64_t before = 0;
+            fields >> username >> partner;
+            if (fields >> limit) {
+                fields >> before;
+            }
+            GraphNode* userNode = batchUser(username, command, out);
+            GraphNode* partnerNode = userNode ? batchUser(partner, command, out) : nullptr;
+            if (!partnerNode) {
+                return;
+            }
+            MessageStore::Page page = socialNetwork.readConversation(userNode, partnerNode, before, limit);
+            out << "messages " << username << ' ' << partner << ' ' << static_cast<int>(page.messages.size())
+                << " next " << page.nextCursor << '\n';
+            for (const MessageStore::PageEntry& entry : page.messages) {
+                out << "  " << entry.number << ' ' << socialNetwork.getUser(entry.message.senderId)->user->name << ": "
+                    << entry.message.content << (entry.unread ? " (unread)" : "") << '\n';
+            }
+        }
+        else if (command == "feed") {
+            string username;
+            int limit = UserProfile::FEED_PAGE_SIZE;
+            uint64_t before = 0;
+            fields >> username;
+            if (fields >> limit) {
+                fields >> before;
+            }
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            NewsfeedService::FeedPage page = socialNetwork.readNewsfeed(userNode, before, limit);
+            out << "feed " << username << ' ' << static_cast<int>(page.postIds.size())
+                << " next " << page.nextCursor << '\n';
+            for (uint64_t postId : page.postIds) {
+                socialNetwork.withPost(postId, [&](const Post& post) {
+                    out << "  " << postId << ' ' << socialNetwork.getUser(post.authorId)->user->name
+                        << ": " << post.content << '\n';
+                });
+            }
+        }
+        else if (command == "searchposts") {
+            PostIndex::Page page = socialNetwork.searchPosts(restOfLine(), 0, UserProfile::FEED_PAGE_SIZE);
+            out << "searchposts " << static_cast<int>(page.postIds.size()) << " next " << page.nextCursor << '\n';
+            for (uint64_t postId : page.postIds) {
+                socialNetwork.withPost(postId, [&](const Post& post) {
+                    out << "  " << postId << ' ' << socialNetwork.getUser(post.authorId)->user->name
+                        << ": " << post.content << '\n';
+                });
+            }
+        }
+        else if (command == "notifications") {
+            string username;
+            fields >> username;
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            vector<pair<NotificationFeed::Entry, bool>> entries = userNode->user->readNotifications();
+            int unread = static_cast<int>(count_if(entries.begin(), entries.end(),
+                [](const pair<NotificationFeed::Entry, bool>& entry) { return entry.second; }));
+            out << "notifications " << username << ' ' << static_cast<int>(entries.size()) << " unread " << unread << '\n';
+            for (const auto& entry : entries) {
+                out << "  " << userNode->user->renderNotification(entry.first) << (entry.second ? " (unread)" : "") << '\n';
+            }
+        }
+        else if (command == "suggest") {
+            string username, scope;
+            int k = SocialNetworkGraph::DEFAULT_SUGGESTIONS;
+            fields >> username;
+            // Both trailing tokens are optional: a number is k, anything else the scope
+            if (fields >> scope && all_of(scope.begin(), scope.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                istringstream(scope) >> k;
+                scope.clear();
+                fields >> scope;
+            }
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            int cityBonus = scope == "local" ? SocialNetworkGraph::SAME_CITY_BONUS : 0;
+            out << "suggest " << username;
+            for (const pair<GraphNode*, int>& suggestion : socialNetwork.topMutualFriends(userNode, k, cityBonus)) {
+                out << ' ' << suggestion.first->user->name << ':' << suggestion.second;
+            }
+            out << '\n';
+        }
+        else if (command == "nearby") {
+            string username;
+            fields >> username;
+            string city = restOfLine();
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            vector<pair<GraphNode*, int>> nearby = socialNetwork.nearbyInCity(userNode,
+                city.empty() ? userNode->user->city : city);
+            out << "nearby " << username << ' ' << static_cast<int>(nearby.size());
+            for (const pair<GraphNode*, int>& person : nearby) {
+                out << ' ' << person.first->user->name << ':' << person.second;
+            }
+            out << '\n';
+        }
+        else if (command == "hops") {
+            string username;
+            int threads = 0;
+            fields >> username;
+            if (!(fields >> threads)) {
+                threads = 0;
+            }
+            GraphNode* userNode = batchUser(username, command, out);
+            if (!userNode) {
+                return;
+            }
+            // Users at each hop distance, found by the parallel BFS
+            vector<int> atDistance;
+            for (int distance : socialNetwork.hopDistances(userNode, threads)) {
+                if (distance > 0) {
+                    if (distance >= static_cast<int>(atDistance.size())) {
+                        atDistance.resize(distance + 1, 0);
+                    }
+                    ++atDistance[distance];
+                }
+            }
+            int reached = 0;
+            for (int count : atDistance) {
+                reached += count;
+            }
+            out << "hops " << username << ' ' << reached;
+            for (size_t distance = 1; distance < atDistance.size(); ++distance) {
+                out << ' ' << distance << ':' << atDistance[distance];
+            }
+            out << '\n';
+        }
+        else if (command == "search") {
+            string query;
+            fields >> query;
+            if (socialNetwork.findUser(query)) {
+                out << "search found " << query << '\n';
+                return;
+            }
+            out << "search prefix " << query;
+            int shown = 0;
+            userSearch.forEachWithPrefix(query, [&](UserProfile* user) {
+                out << ' ' << user->name;
+                return ++shown < MAX_SEARCH_RESULTS;
+            });
+            out << '\n';
+        }
+        else {
+            out << "error unknown command " << command << '\n';
+        }
+    }
 
 public:
     SocialNetworkApp() : currentUser(nullptr) {}
 
+    // Restores the network from the snapshot at path, if there is one, and
+    // replays its write-ahead log (path + ".wal"), which then records every
+    // later change. Must run before any other use of the app.
+    void openStorage(const string& path) {
+        if (ifstream(path, ios::binary)) {
+            socialNetwork.loadSnapshot(path);
+        }
+        socialNetwork.openLog(path + ".wal");
+        for (int id = 0; id < socialNetwork.userCount(); ++id) {
+            userSearch.addUser(socialNetwork.getUser(id)->user);
+        }
+    }
+
+    // Builds the network from bulk dumps (see SocialNetworkGraph::importNetwork)
+    // instead of openStorage. With a storage path, which must not hold a
+    // network yet, the result is saved there and later changes are logged.
+    void importNetwork(const string& usersPath, const string& edgesPath, const string& storagePath) {
+        if (!storagePath.empty() && (ifstream(storagePath) || ifstream(storagePath + ".wal"))) {
+            throw runtime_error(storagePath + " already holds a network");
+        }
+        long long follows = socialNetwork.importNetwork(usersPath, edgesPath);
+        vector<UserProfile*> users;
+        users.reserve(socialNetwork.userCount());
+        for (int id = 0; id < socialNetwork.userCount(); ++id) {
+            users.push_back(socialNetwork.getUser(id)->user);
+        }
+        userSearch.build(std::move(users));
+        if (!storagePath.empty()) {
+            socialNetwork.saveSnapshot(storagePath);
+            socialNetwork.openLog(storagePath + ".wal");
+        }
+        clog << "Imported " << socialNetwork.userCount() << " users and " << follows << " follows" << endl;
+    }
+
+    void saveSnapshot(const string& path) {
+        socialNetwork.saveSnapshot(path);
+    }
+
     void run() {
         int mainChoice;
         bool isRunning = true;
@@ -1029,9 +6646,20 @@ public:
                     currentUser->user->createPost(postContent);
                     break;
                 }
-                case 4:
-                    currentUser->user->displayTimeline();
+                case 4: {
+                    uint64_t cursor = currentUser->user->displayTimeline();
+                    while (cursor != 0) {
+                        char more;
+                        cout << "Load more posts? (y/n): ";
+                        cin >> more;
+                        cin.ignore();
+                        if (more != 'y' && more != 'Y') {
+                            break;
+                        }
+                        cursor = currentUser->user->displayTimeline(cursor);
+                    }
                     break;
+                }
                 case 5:
                     currentUser->user->displayNotifications();
                     break;
@@ -1046,6 +6674,12 @@ public:
                     currentUser->user->displayFollowers();
                     break;
                 case 9:
+                    searchPosts();
+                    break;
+                case 10:
+                    peopleNearYou();
+                    break;
+                case 11:
                     currentUser = nullptr;
                     cout << "Logged out successfully!" << endl;
                     break;
@@ -1055,10 +6689,325 @@ public:
             }
         }
     }
+
+    // Headless mode: executes one command per line from input, e.g.
+    //   signup <name> <password> [city]    follow <requester> <target>
+    //   accept <user> <requester>          post <author> <text>
+    //   message <sender> <recipient> <text>
+    //   inbox <user>                       messages <user> <partner> [limit] [before]
+    //   feed <user> [limit] [before]       suggest <user> [k] [local]
+    //   nearby <user> [city]
+    //   search <name or prefix>            searchposts <words>
+    // Blank lines and lines starting with '#' are skipped.
+    void runBatch(istream& input, ostream& output) {
+        BatchOutput out(output);
+        string line;
+        while (getline(input, line)) {
+            executeCommand(line, out);
+        }
+    }
+};
+
+// Synthetic workload benchmark. Builds a Barabasi-Albert (preferential
+// attachment) follower graph through the regular signup, follow/accept and
+// post paths, times the hot read and write operations and prints the
+// results as one JSON object.
+class WorkloadBenchmark {
+public:
+    struct Config {
+        int users = 100000;
+        int edgesPerUser = 5;   // Attachment count m of the BA model
+        int posts = 200000;
+        int messages = 200000;  // Timed sendMessage calls
+        int lookups = 100000;
+        int traversals = 20;    // Full BFS traversals from random users, each kind
+        int bfsThreads = 0;     // Threads for the parallel BFS; 0 uses every hardware thread
+        int suggestions = 10000;
+        int timelines = 100000;
+        int searches = 100000;  // Two-word post searches
+        uint64_t seed = 42;
+    };
+
+private:
+    struct OperationStats {
+        string name;
+        int ops;
+        double seconds;
+        double p50Micros;
+        double p99Micros;
+    };
+
+    typedef chrono::steady_clock Clock;
+
+    Config config;
+    mt19937_64 rng;
+    SocialNetworkGraph network;
+    vector<GraphNode*> users;
+    vector<OperationStats> results;
+    double loadSeconds;
+    long long edges;
+
+    static double secondsSince(Clock::time_point start) {
+        return chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    static string userName(int index) {
+        return "user" + to_string(index);
+    }
+
+    int randomUser() {
+        return static_cast<int>(rng() % users.size());
+    }
+
+    // Runs op(i) count times and records each call's latency
+    template <typename Op>
+    void measure(const string& name, int count, Op&& op) {
+        vector<double> latencies;
+        latencies.reserve(count);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < count; ++i) {
+            Clock::time_point opStart = Clock::now();
+            op(i);
+            latencies.push_back(chrono::duration<double, micro>(Clock::now() - opStart).count());
+        }
+        double seconds = secondsSince(start);
+        sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) {
+            return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+        };
+        results.push_back(OperationStats{ name, count, seconds, percentile(0.50), percentile(0.99) });
+    }
+
+    // Every new user follows edgesPerUser distinct earlier users, picked with
+    // probability proportional to their degree, and each request is accepted
+    void buildGraph() {
+        vector<int> endpoints; // Each user appears once per incident edge
+        endpoints.reserve(static_cast<size_t>(config.users) * config.edgesPerUser * 2);
+        vector<int> targets;
+        for (int v = 0; v < config.users; ++v) {
+            UserProfile* profile = new UserProfile(userName(v), "Bench@123", "", "", "");
+            GraphNode* node = new GraphNode(profile);
+            network.addUser(node);
+            users.push_back(node);
+
+            targets.clear();
+            if (v <= config.edgesPerUser) {
+                for (int u = 0; u < v; ++u) {
+                    targets.push_back(u);
+                }
+            }
+            else {
+                while (static_cast<int>(targets.size()) < config.edgesPerUser) {
+                    int candidate = endpoints[rng() % endpoints.size()];
+                    if (find(targets.begin(), targets.end(), candidate) == targets.end()) {
+                        targets.push_back(candidate);
+                    }
+                }
+            }
+            for (int u : targets) {
+                profile->sendFollowRequest(node, users[u]);
+                users[u]->user->acceptFollowRequest(users[u], node);
+                endpoints.push_back(u);
+                endpoints.push_back(v);
+                ++edges;
+            }
+        }
+    }
+
+    void printJson(ostream& out) const {
+        out << fixed << setprecision(3);
+        out << "{\n";
+        out << "  \"config\": {\"users\": " << config.users << ", \"edgesPerUser\": " << config.edgesPerUser
+            << ", \"posts\": " << config.posts << ", \"messages\": " << config.messages
+            << ", \"bfsThreads\": " << config.bfsThreads << ", \"seed\": " << config.seed << "},\n";
+        out << "  \"load\": {\"seconds\": " << loadSeconds << ", \"edges\": " << edges << "},\n";
+        out << "  \"operations\": {\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const OperationStats& stats = results[i];
+            double opsPerSec = stats.seconds > 0 ? stats.ops / stats.seconds : 0.0;
+            out << "    \"" << stats.name << "\": {\"ops\": " << stats.ops
+                << ", \"opsPerSec\": " << opsPerSec
+                << ", \"p50Micros\": " << stats.p50Micros
+                << ", \"p99Micros\": " << stats.p99Micros << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "  },\n";
+        out << "  \"peakRssKb\": " << peakRssKb() << "\n";
+        out << "}\n";
+    }
+
+public:
+    explicit WorkloadBenchmark(const Config& benchmarkConfig) :
+        config(benchmarkConfig), rng(benchmarkConfig.seed), loadSeconds(0), edges(0) {}
+
+    // Peak resident set size of this process in kilobytes
+    static long long peakRssKb() {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+            return static_cast<long long>(counters.PeakWorkingSetSize / 1024);
+        }
+        return 0;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // Reported in bytes
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    }
+
+    void run(ostream& out) {
+        Clock::time_point start = Clock::now();
+        buildGraph();
+        for (int i = 0; i < config.posts; ++i) {
+            users[randomUser()]->user->createPost("Benchmark post " + to_string(i));
+        }
+        loadSeconds = secondsSince(start);
+
+        measure("findUser", config.lookups, [&](int) {
+            network.findUser(userName(randomUser()));
+        });
+        measure("bfsTraversal", config.traversals, [&](int) {
+            int visited = 0;
+            network.bfs(users[randomUser()], [&](GraphNode*, int) {
+                ++visited;
+                return true;
+            });
+        });
+        measure("parallelBfs", config.traversals, [&](int) {
+            network.hopDistances(users[randomUser()], config.bfsThreads);
+        });
+        measure("suggestMutualFriends", config.suggestions, [&](int) {
+            network.topMutualFriends(users[randomUser()], SocialNetworkGraph::DEFAULT_SUGGESTIONS);
+        });
+        measure("timelineRead", config.timelines, [&](int) {
+            NewsfeedService::FeedPage page = network.readNewsfeed(users[randomUser()], 0, UserProfile::FEED_PAGE_SIZE);
+            size_t bytes = 0;
+            for (uint64_t postId : page.postIds) {
+                bytes += network.withPost(postId, [](const Post& post) { return post.content.size(); });
+            }
+            (void)bytes;
+        });
+        measure("postSearch", config.searches, [&](int) {
+            // Every post has "post" and one has the number: a long list
+            // intersected with a one-entry list
+            network.searchPosts("post " + to_string(rng() % max(1, config.posts)), 0, UserProfile::FEED_PAGE_SIZE);
+        });
+        measure("sendMessage", config.messages, [&](int i) {
+            GraphNode* sender = users[randomUser()];
+            GraphNode* recipient = users[randomUser()];
+            sender->user->sendMessage(recipient->user, "Benchmark message " + to_string(i));
+        });
+
+        printJson(out);
+    }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+    // --bench [key=value ...] runs the synthetic workload and prints JSON
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        WorkloadBenchmark::Config config;
+        for (int i = 2; i < argc; ++i) {
+            string option = argv[i];
+            size_t equals = option.find('=');
+            string key = option.substr(0, equals);
+            long long value = equals == string::npos ? -1 : atoll(option.c_str() + equals + 1);
+            if (value < 0) {
+                cerr << "Expected key=value, got " << option << endl;
+                return 1;
+            }
+            if (key == "users") config.users = max(1, static_cast<int>(value));
+            else if (key == "degree") config.edgesPerUser = max(1, static_cast<int>(value));
+            else if (key == "posts") config.posts = static_cast<int>(value);
+            else if (key == "messages") config.messages = static_cast<int>(value);
+            else if (key == "lookups") config.lookups = static_cast<int>(value);
+            else if (key == "traversals") config.traversals = static_cast<int>(value);
+            else if (key == "threads") config.bfsThreads = static_cast<int>(value);
+            else if (key == "suggestions") config.suggestions = static_cast<int>(value);
+            else if (key == "timelines") config.timelines = static_cast<int>(value);
+            else if (key == "searches") config.searches = static_cast<int>(value);
+            else if (key == "seed") config.seed = static_cast<uint64_t>(value);
+            else {
+                cerr << "Unknown benchmark option " << key << endl;
+                return 1;
+            }
+        }
+        WorkloadBenchmark benchmark(config);
+        benchmark.run(cout);
+        return 0;
+    }
+
     SocialNetworkApp app;
-    app.run();
+    int arg = 1;
+
+    // --snapshot <file> restores the network from file and its write-ahead
+    // log, logs every change, and saves a fresh snapshot on exit
+    string snapshotPath;
+    if (argc > arg + 1 && string(argv[arg]) == "--snapshot") {
+        snapshotPath = argv[arg + 1];
+        arg += 2;
+    }
+
+    // --import <users.csv> <edges> builds a new network from bulk dumps
+    if (argc > arg + 2 && string(argv[arg]) == "--import") {
+        try {
+            app.importNetwork(argv[arg + 1], argv[arg + 2], snapshotPath);
+        }
+        catch (const exception& error) {
+            cerr << "Failed to import: " << error.what() << endl;
+            return 1;
+        }
+        arg += 3;
+    }
+    else if (!snapshotPath.empty()) {
+        try {
+            app.openStorage(snapshotPath);
+        }
+        catch (const exception& error) {
+            cerr << "Failed to restore " << snapshotPath << ": " << error.what() << endl;
+            return 1;
+        }
+    }
+
+    // --batch [file] runs a command stream (stdin by default) without menus.
+    // A change that could not be logged stops the session; the snapshot is
+    // not saved, so the files on disk keep the last durable state.
+    try {
+        if (argc > arg && string(argv[arg]) == "--batch") {
+            ios::sync_with_stdio(false);
+            cin.tie(nullptr);
+            if (argc > arg + 1) {
+                ifstream input(argv[arg + 1]);
+                if (!input) {
+                    cerr << "Cannot open " << argv[arg + 1] << endl;
+                    return 1;
+                }
+                app.runBatch(input, cout);
+            }
+            else {
+                app.runBatch(cin, cout);
+            }
+        }
+        else {
+            app.run();
+        }
+    }
+    catch (const StorageFailure& error) {
+        cerr << "Storage failed, stopping: " << error.what() << endl;
+        return 1;
+    }
+
+    if (!snapshotPath.empty()) {
+        try {
+            app.saveSnapshot(snapshotPath);
+        }
+        catch (const exception& error) {
+            cerr << "Failed to save snapshot: " << error.what() << endl;
+            return 1;
+        }
+    }
     return 0;
 }